@@ -5,12 +5,29 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
 
 #define __GB__
 
 #define ROM_SIZE            0x8000
 #define RAM_SIZE            0x8000
-#define MAIN_MEORY_SIZE     0xffff
+#define MAIN_MEORY_SIZE     0x10000
 
 struct register_t {
     // 16-bit register structure:
@@ -113,7 +130,15 @@ struct memory_t {
         };
         uint8_t blocks[MAIN_MEORY_SIZE];
     };
-    uint16_t size;
+    uint32_t size;
+    // Cartridge bytes hidden under the boot ROM, mapped back in by
+    // the write to $FF50 that ends the boot sequence.
+    uint8_t cartridge_head[0x0100];
+    uint8_t boot_rom_mapped;
+    // Trap flags per 256 byte page of the bus. Accesses to a page
+    // without flags take the plain path, others are handed to
+    // memory_trap() to match against watchpoints and run conditions.
+    uint8_t page_traps[0x100];
 };
 
 uint8_t boot_rom[0x0100] =
@@ -138,13 +163,211 @@ uint8_t boot_rom[0x0100] =
     0xF5, 0x06, 0x19, 0x78, 0x86, 0x23, 0x05, 0x20, 0xFB, 0x86, 0x20, 0xFE, 0x3E, 0x01, 0xE0, 0x50
 };
 
+uint8_t opcode_cycles[0x100] =
+{
+    // Machine cycles (in clocks) per opcode. Conditional jumps, calls
+    // and returns list the not-taken count, the branch helpers add the
+    // rest. $CB is counted by cb_opcode_cycles as a whole.
+    //  x0  x1  x2  x3  x4  x5  x6  x7  x8  x9  xA  xB  xC  xD  xE  xF
+     4, 12,  8,  8,  4,  4,  8,  4, 20,  8,  8,  8,  4,  4,  8,  4,    // 0x
+     4, 12,  8,  8,  4,  4,  8,  4, 12,  8,  8,  8,  4,  4,  8,  4,    // 1x
+     8, 12,  8,  8,  4,  4,  8,  4,  8,  8,  8,  8,  4,  4,  8,  4,    // 2x
+     8, 12,  8,  8, 12, 12, 12,  4,  8,  8,  8,  8,  4,  4,  8,  4,    // 3x
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,    // 4x
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,    // 5x
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,    // 6x
+     8,  8,  8,  8,  8,  8,  4,  8,  4,  4,  4,  4,  4,  4,  8,  4,    // 7x
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,    // 8x
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,    // 9x
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,    // Ax
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,    // Bx
+     8, 12, 12, 16, 12, 16,  8, 16,  8, 16, 12,  0, 12, 24,  8, 16,    // Cx
+     8, 12, 12,  0, 12, 16,  8, 16,  8, 16, 12,  0, 12,  0,  8, 16,    // Dx
+    12, 12,  8,  0,  0, 16,  8, 16, 16,  4, 16,  0,  0,  0,  8, 16,    // Ex
+    12, 12,  8,  4,  0, 16,  8, 16, 12,  8, 16,  4,  0,  0,  8, 16,    // Fx
+};
+
+static uint8_t cb_opcode_cycles(uint8_t cb_opcode)
+{
+    // Register operands take 8 clocks, (HL) operands 16, except
+    // BIT b, (HL) which only reads and takes 12.
+    if ((cb_opcode & 0x07) != 0x06) return 8;
+    return (cb_opcode & 0xc0) == 0x40 ? 12 : 16;
+}
+
+#define SCREEN_WIDTH        160
+#define SCREEN_HEIGHT       144
+
+struct frame_buffers_t;
+
+struct ppu_t {
+    // Clock at which the current scanline started.
+    uint64_t line_start;
+    // Frames completed, counted on entering VBlank.
+    uint64_t frames;
+    // Window rows drawn so far this frame.
+    uint8_t window_line;
+    // Render target, one shade (0-3) per pixel. NULL skips rendering,
+    // the timing runs all the same.
+    uint8_t *framebuffer;
+    // Finished frames are published here, if attached.
+    struct frame_buffers_t *frames_out;
+};
+
+struct apu_channel_t {
+    uint8_t enabled;
+    uint8_t dac;
+    // Current digital output, 0-15, and the stereo level last put
+    // into the synthesis buffer for it.
+    uint8_t output;
+    int16_t level_left;
+    int16_t level_right;
+    // Clock of the next waveform step and the step index.
+    uint64_t next_step;
+    uint8_t position;
+    uint32_t period;
+    uint8_t duty;
+    uint8_t wave_shift;
+    uint16_t length;
+    uint8_t length_enable;
+    uint8_t volume;
+    uint8_t envelope_timer;
+    // Channel 1 frequency sweep.
+    uint16_t sweep_frequency;
+    uint8_t sweep_timer;
+    uint8_t sweep_enable;
+    // Channel 4 linear feedback shift register.
+    uint16_t lfsr;
+    uint8_t lfsr_width;
+};
+
+struct audio_output_t;
+
+struct apu_t {
+    struct apu_channel_t channel[4];
+    // Channels are synthesized up to this clock.
+    uint64_t clock;
+    // Clock of the next frame sequencer tick, and its step (0-7).
+    uint64_t next_tick;
+    uint8_t sequencer_step;
+    uint8_t power;
+    // Master volume and panning as of the last catch-up.
+    uint8_t nr50;
+    uint8_t nr51;
+    // Synthesis target. NULL mutes the APU: only the frame sequencer
+    // runs, which is all of the APU timing a guest can observe.
+    struct audio_output_t *output;
+};
+
+struct serial_t {
+    // Clock at which the running internal clock transfer ends, 0 if
+    // none is running.
+    uint64_t transfer_end;
+};
+
+struct joypad_t {
+    // JOYPAD_* buttons held down.
+    uint8_t buttons;
+    // P1 input lines as last computed, to see them fall.
+    uint8_t lines;
+};
+
+struct cgb_t {
+    // Set from the cartridge header when the ROM is loaded. All other
+    // fields are unused in DMG mode.
+    uint8_t enabled;
+    // KEY1 bit 7. CPU clocks are shifted right by this, so devices
+    // keep counting 4.19 MHz clocks in either mode.
+    uint8_t double_speed;
+    uint8_t vram_bank;
+    uint8_t wram_bank;
+    // Backing store of the VRAM and WRAM banks. The selected banks are
+    // copied into memory.blocks, so the bus stays a flat array; their
+    // slots here are stale until they are switched out again.
+    uint8_t vram[2][0x2000];
+    uint8_t wram[8][0x1000];
+    // Palette RAM: 8 palettes of 4 little endian RGB555 colors each.
+    uint8_t bg_palettes[64];
+    uint8_t obj_palettes[64];
+    // HDMA source and VRAM offset of the next block, and the 16 byte
+    // blocks left of a transfer running in HBlank mode.
+    uint16_t hdma_source;
+    uint16_t hdma_destination;
+    uint8_t hdma_blocks;
+};
+
+struct profiler_t;
+struct debugger_t;
+struct hash_log_t;
+struct movie_t;
+struct link_port_t;
+struct metrics_t;
+
 struct gameboy_emulator_t {
     struct cpu_core_t cpu;
     struct memory_t memory;
+    struct ppu_t ppu;
+    struct apu_t apu;
+    struct serial_t serial;
+    struct joypad_t joypad;
+    struct cgb_t cgb;
 
     uint8_t opcode;
+    // Clocks elapsed since power up, at 4.19 MHz. In double speed mode
+    // instructions take half as many of them.
+    uint64_t cycles;
+    // Scheduler. next_event is the clock of the next PPU event, the
+    // run loop executes instructions until cycles reaches slice_end,
+    // which a trap may pull in to stop after the current instruction.
+    uint64_t next_event;
+    uint64_t slice_end;
+    // Address of the byte a run_until() memory condition watches.
+    uint8_t run_watch;
+    uint16_t run_watch_addr;
+    // Print every executed opcode. Handy when stepping through a
+    // failing ROM, but far too slow for anything else.
+    uint8_t trace;
+    // Set faulted and stop on an unimplemented opcode, rather than
+    // exit the process.
+    uint8_t contain_faults;
+    uint8_t faulted;
+    // Optional execution profiler, NULL unless attached.
+    struct profiler_t *profiler;
+    // Optional debugger, NULL unless attached.
+    struct debugger_t *debugger;
+    // Optional frame and state hash log, NULL unless attached.
+    struct hash_log_t *hash_log;
+    // Input movie being recorded or played, NULL if none.
+    struct movie_t *movie;
+    // Link cable peer, NULL if unplugged.
+    struct link_port_t *link;
+    // Exported runtime counters, NULL unless attached.
+    struct metrics_t *metrics;
 };
 
+#define CLOCKS_PER_LINE     456
+#define LINES_PER_FRAME     154
+#define VBLANK_LINE         144
+
+#define TRAP_READ           0x01
+#define TRAP_WRITE          0x02
+// Writes to the I/O registers at $FF00-$FF7F have side effects. A
+// separate flag keeps the rest of the page, HRAM and often the stack,
+// off the trap path.
+#define TRAP_IO             0x04
+
+static void memory_trap(struct gameboy_emulator_t *emulator, uint16_t addr, uint8_t access);
+static void memory_update_page_traps(struct gameboy_emulator_t *emulator);
+static uint64_t movie_step(struct gameboy_emulator_t *emulator);
+static void cgb_stop(struct gameboy_emulator_t *emulator);
+static void cgb_power_up(struct gameboy_emulator_t *emulator);
+static void debugger_trap(struct gameboy_emulator_t *emulator, uint16_t addr, uint8_t access);
+static void debugger_set_page_traps(struct gameboy_emulator_t *emulator);
+static inline int debugger_stop(struct gameboy_emulator_t *emulator);
+static void debugger_resume(struct gameboy_emulator_t *emulator);
+static int debugger_stopped(const struct gameboy_emulator_t *emulator);
+void emulator_set_buttons(struct gameboy_emulator_t *emulator, uint8_t buttons);
+
 static uint8_t read_8_bit_immed_data_from_memory(struct gameboy_emulator_t *emulator) 
 {
     uint16_t addr = emulator->cpu.reg.pc.data;
@@ -154,31 +377,49 @@ static uint8_t read_8_bit_immed_data_from_memory(struct gameboy_emulator_t *emul
 
 static uint8_t read_8_bit_from_memory(struct gameboy_emulator_t *emulator, uint16_t addr) 
 {
+    if (emulator->memory.page_traps[addr >> 0x08] & TRAP_READ) memory_trap(emulator, addr, TRAP_READ);
     return emulator->memory.blocks[addr];
 }
 
 
 static void write_8_bit_to_memory(struct gameboy_emulator_t *emulator, uint8_t data, uint16_t addr)
 {
+    // Write traps run after the store, so handlers see the new value.
+    uint8_t traps = emulator->memory.page_traps[addr >> 0x08];
+
     emulator->memory.blocks[addr] = data;
+    if ((traps & TRAP_WRITE) || ((traps & TRAP_IO) && addr < 0xff80)) memory_trap(emulator, addr, TRAP_WRITE);
 }
 
 static uint16_t read_16_bit_from_memory(struct gameboy_emulator_t *emulator, uint16_t addr) 
 {
-    return (((emulator->memory.blocks[addr + 1] << 8) & 0xff00) | (emulator->memory.blocks[addr] & 0xff)) & 0xffff;
+    if ((emulator->memory.page_traps[addr >> 0x08] | emulator->memory.page_traps[((addr + 1) & 0xffff) >> 0x08]) & TRAP_READ)
+    {
+        memory_trap(emulator, addr, TRAP_READ);
+        memory_trap(emulator, addr + 1, TRAP_READ);
+    }
+    return (((emulator->memory.blocks[(uint16_t) (addr + 1)] << 8) & 0xff00) | (emulator->memory.blocks[addr] & 0xff)) & 0xffff;
 }
 
 static uint16_t read_16_bit_immed_data_from_memory(struct gameboy_emulator_t *emulator) 
 {
+    // Operand fetches are not data reads, so they skip the traps.
     uint16_t addr = emulator->cpu.reg.pc.data;
     emulator->cpu.reg.pc.data = emulator->cpu.reg.pc.data + 2;
-    return read_16_bit_from_memory(emulator, addr);
+    return (((emulator->memory.blocks[(uint16_t) (addr + 1)] << 8) & 0xff00) | (emulator->memory.blocks[addr] & 0xff)) & 0xffff;
 }
 
 static void write_16_bit_to_memory(struct gameboy_emulator_t *emulator, uint16_t data, uint16_t addr)
 {
+    uint8_t traps = emulator->memory.page_traps[addr >> 0x08] | emulator->memory.page_traps[((addr + 1) & 0xffff) >> 0x08];
+
     emulator->memory.blocks[addr] = data & 0xff;
-    emulator->memory.blocks[addr + 1] = (data >> 0x08) & 0xff;
+    emulator->memory.blocks[(uint16_t) (addr + 1)] = (data >> 0x08) & 0xff;
+    if ((traps & TRAP_WRITE) || ((traps & TRAP_IO) && addr >= 0xfeff && addr < 0xff80))
+    {
+        memory_trap(emulator, addr, TRAP_WRITE);
+        memory_trap(emulator, addr + 1, TRAP_WRITE);
+    }
 }
 
 static void load_r_immed_data(struct gameboy_emulator_t *emulator, uint8_t dst, uint16_t addr)
@@ -333,6 +574,34 @@ static void cp_a_r(struct gameboy_emulator_t *emulator)
     cpu->flags.h_flag = (((a & 0x0f) - (r & 0x0f)) < 0);
 }
 
+static void add_a_hl(struct gameboy_emulator_t *emulator)
+{
+    struct cpu_core_t *cpu = (struct cpu_core_t*) &emulator->cpu;
+
+    uint8_t a      = cpu->reg.af.high;
+    uint8_t data   = read_8_bit_from_memory(emulator, cpu->reg.hl.data);
+
+    cpu->reg.af.high = a + data;
+
+    cpu->flags.n_flag = 0;
+    cpu->flags.z_flag = ((uint8_t) (a + data) == 0);
+    cpu->flags.c_flag = (((a & 0xff) + (data & 0xff)) >> 0x08) & 0x01;
+    cpu->flags.h_flag = (((a & 0x0f) + (data & 0x0f)) >> 0x04) & 0x01;
+}
+
+static void cp_a_hl(struct gameboy_emulator_t *emulator)
+{
+    struct cpu_core_t *cpu = (struct cpu_core_t*) &emulator->cpu;
+
+    uint8_t a_reg = cpu->reg.af.high;
+    uint8_t data  = read_8_bit_from_memory(emulator, cpu->reg.hl.data);
+
+    cpu->flags.n_flag = 1;
+    cpu->flags.c_flag = data > a_reg;
+    cpu->flags.z_flag = (a_reg == data);
+    cpu->flags.h_flag = (((a_reg & 0x0f) - (data & 0x0f)) < 0);
+}
+
 static void cp_a_n(struct gameboy_emulator_t *emulator)
 {
     struct cpu_core_t *cpu = (struct cpu_core_t*) &emulator->cpu;
@@ -460,125 +729,90 @@ static void bit_operations(struct gameboy_emulator_t *emulator)
 
     uint8_t data = read_8_bit_immed_data_from_memory(emulator);
     uint8_t r = data & 0x07;
+    uint8_t index = (data >> 0x03) & 0x07;
+
+    emulator->cycles += cb_opcode_cycles(data) >> emulator->cgb.double_speed;
 
+    // Operand 6 is (HL), which has no register in the map and goes
+    // through the bus like any other memory operand.
+    uint8_t value = r == 0x06 ? read_8_bit_from_memory(emulator, cpu->reg.hl.data) : *(cpu->reg.cpu_8_bit_reg_map[r]);
     uint8_t save_result = 1;
     uint8_t affect_flags= 1;
-    uint8_t results;
+    uint8_t results = value;
 
     uint8_t carry_bit = cpu->flags.c_flag;
     uint8_t h_flag = cpu->flags.h_flag;
 
-    // Skipped rlc (hl) instruction
     switch(data)
     {
-        case 0x07:
-        case 0x00 ... 0x05:  // RLC r
+        case 0x00 ... 0x07:  // RLC r
         {
-            carry_bit = (*(cpu->reg.cpu_8_bit_reg_map[r]) & 0x80) != 0;
-            results = (*(cpu->reg.cpu_8_bit_reg_map[r]) << 1) | carry_bit;
+            carry_bit = (value & 0x80) != 0;
+            results = (value << 1) | carry_bit;
             break;
         }
-        case 0x17:
-        case 0x10 ... 0x15: // RL r
+        case 0x10 ... 0x17: // RL r
         {
-            results  = (*(cpu->reg.cpu_8_bit_reg_map[r]) << 1) | cpu->flags.c_flag;
-            carry_bit = (*(cpu->reg.cpu_8_bit_reg_map[r]) & 0x80) != 0;
+            results  = (value << 1) | cpu->flags.c_flag;
+            carry_bit = (value & 0x80) != 0;
             break;
         }
-        case 0x0f:
-        case 0x08 ... 0x0d:  // RRC r
+        case 0x08 ... 0x0f:  // RRC r
         {
-            carry_bit = (*(cpu->reg.cpu_8_bit_reg_map[r]) & 0x01) != 0;
-            results = (*(cpu->reg.cpu_8_bit_reg_map[r]) >> 1) | (carry_bit << 0x07);
+            carry_bit = (value & 0x01) != 0;
+            results = (value >> 1) | (carry_bit << 0x07);
             break;
         }
-        case 0x1f:
-        case 0x18 ... 0x1d:  // RR  r
+        case 0x18 ... 0x1f:  // RR  r
         {
-            carry_bit = (*(cpu->reg.cpu_8_bit_reg_map[r]) & 0x01) != 0;
-            results  = (*(cpu->reg.cpu_8_bit_reg_map[r]) >> 1) | (cpu->flags.c_flag << 0x07);
+            carry_bit = (value & 0x01) != 0;
+            results  = (value >> 1) | (cpu->flags.c_flag << 0x07);
             break;
         }
-        case 0x27:
-        case 0x20 ... 0x25: // SLA r
+        case 0x20 ... 0x27: // SLA r
         {
-            carry_bit = (*(cpu->reg.cpu_8_bit_reg_map[r]) & 0x80) != 0;
-            results = (*(cpu->reg.cpu_8_bit_reg_map[r]) << 1);
+            carry_bit = (value & 0x80) != 0;
+            results = (value << 1);
             break;
         }
-        case 0x2f:
-        case 0x28 ... 0x2d: // SRA r
+        case 0x28 ... 0x2f: // SRA r
         {
-            carry_bit = (*(cpu->reg.cpu_8_bit_reg_map[r]) & 0x01) != 0;
-            results = (*(cpu->reg.cpu_8_bit_reg_map[r]) >> 1) | ((*(cpu->reg.cpu_8_bit_reg_map[r]) & 0x80));
+            carry_bit = (value & 0x01) != 0;
+            results = (value >> 1) | (value & 0x80);
             break;
         }
-        case 0x3f:
-        case 0x38 ... 0x3d: // SRL r
+        case 0x30 ... 0x37: // SWAP r
         {
-            carry_bit = (*(cpu->reg.cpu_8_bit_reg_map[r]) & 0x01) != 0;
-            results = (*(cpu->reg.cpu_8_bit_reg_map[r]) >> 1) & 0xff;
+            carry_bit = 0;
+            h_flag = 0;
+            results = (value << 4) | (value >> 4);
             break;
         }
-        case 0x40 ... 0x45: // BIT b, r
-        case 0x47 ... 0x4d:
-        case 0x4f:
-        case 0x50 ... 0x55:
-        case 0x57 ... 0x5d:
-        case 0x5f:
-        case 0x60 ... 0x65:
-        case 0x67 ... 0x6d:
-        case 0x6f:
-        case 0x70 ... 0x75:
-        case 0x77 ... 0x7d:
-        case 0x7f:
-        {
-            uint8_t index = (data >> 0x03 ) & 0x07;
-            results = *(cpu->reg.cpu_8_bit_reg_map[r]) & (1 << index);
+        case 0x38 ... 0x3f: // SRL r
+        {
+            carry_bit = (value & 0x01) != 0;
+            results = (value >> 1) & 0xff;
+            break;
+        }
+        case 0x40 ... 0x7f: // BIT b, r
+        {
+            results = value & (1 << index);
             save_result = 0;
             h_flag = 1;
             break;
         }
-        case 0x80 ... 0x85: // RES b, r
-        case 0x87 ... 0x8d:
-        case 0x8f:
-        case 0x90 ... 0x95:
-        case 0x97 ... 0x9d:
-        case 0x9f:
-        case 0xa0 ... 0xa5:
-        case 0xa7 ... 0xad:
-        case 0xaf:
-        case 0xb0 ... 0xb5:
-        case 0xb7 ... 0xbd:
-        case 0xbf:
+        case 0x80 ... 0xbf: // RES b, r
         {
-            uint8_t index = (data >> 0x03 ) & 0x07;
-            results = *(cpu->reg.cpu_8_bit_reg_map[r]) & ~(1 << index); 
-            save_result = 1;
+            results = value & ~(1 << index);
             affect_flags = 0;
             break;
         }
-        case 0xc0 ... 0xc5: // SET b, r
-        case 0xc7 ... 0xcd:
-        case 0xcf:
-        case 0xd0 ... 0xd5:
-        case 0xd7 ... 0xdd:
-        case 0xdf:
-        case 0xe0 ... 0xe5:
-        case 0xe7 ... 0xed:
-        case 0xef:
-        case 0xf0 ... 0xf5:
-        case 0xf7 ... 0xfd:
-        case 0xff:
-        {
-            uint8_t index = (data >> 0x03 ) & 0x07;
-            results = *(cpu->reg.cpu_8_bit_reg_map[r]) | (1 << index); 
-            save_result = 1;
+        case 0xc0 ... 0xff: // SET b, r
+        {
+            results = value | (1 << index);
             affect_flags = 0;
             break;
         }
-        defualt:
-            break;
     }
 
     if (affect_flags)
@@ -589,7 +823,9 @@ static void bit_operations(struct gameboy_emulator_t *emulator)
         cpu->flags.h_flag = h_flag;
     }
 
-    if (save_result) *(cpu->reg.cpu_8_bit_reg_map[r]) = results;
+    if (!save_result) return;
+    if (r == 0x06) write_8_bit_to_memory(emulator, results, cpu->reg.hl.data);
+    else *(cpu->reg.cpu_8_bit_reg_map[r]) = results;
 }
 
 static void ld_rr_nn(struct gameboy_emulator_t *emulator)
@@ -620,7 +856,11 @@ static void jump_cc_nn(struct gameboy_emulator_t *emulator, uint16_t addr)
         case 0xd2: should_jump = !emulator->cpu.flags.c_flag; break;
         case 0xda: should_jump = emulator->cpu.flags.c_flag;  break;
     }
-    if (should_jump) jump_nn(emulator, addr);
+    if (should_jump)
+    {
+        jump_nn(emulator, addr);
+        emulator->cycles += 4 >> emulator->cgb.double_speed;
+    }
 }
 
 static void jump_cc_n(struct gameboy_emulator_t *emulator, uint8_t addr)
@@ -633,16 +873,20 @@ static void jump_cc_n(struct gameboy_emulator_t *emulator, uint8_t addr)
         case 0x30: should_jump = !emulator->cpu.flags.c_flag; break;
         case 0x38: should_jump = emulator->cpu.flags.c_flag;  break;
     }
-    if (should_jump) jump_n(emulator, addr);
+    if (should_jump)
+    {
+        jump_n(emulator, addr);
+        emulator->cycles += 4 >> emulator->cgb.double_speed;
+    }
 }
 
 static void call_nn(struct gameboy_emulator_t *emulator, uint16_t addr)
 {
     struct cpu_core_t *cpu = (struct cpu_core_t*) &emulator->cpu;
     
+    cpu->reg.sp.data = cpu->reg.sp.data - 2;
     write_16_bit_to_memory(emulator, cpu->reg.pc.data, cpu->reg.sp.data);
     cpu->reg.pc.data = addr;
-    cpu->reg.sp.data = cpu->reg.sp.data - 2;
 }
 
 static void call_cc_nn(struct gameboy_emulator_t *emulator, uint16_t addr)
@@ -655,17 +899,29 @@ static void call_cc_nn(struct gameboy_emulator_t *emulator, uint16_t addr)
         case 0xd4: should_jump = !emulator->cpu.flags.c_flag; break;
         case 0xdc: should_jump = emulator->cpu.flags.c_flag;  break;
     }
-    if (should_jump) call_nn(emulator, addr);
+    if (should_jump)
+    {
+        call_nn(emulator, addr);
+        emulator->cycles += 12 >> emulator->cgb.double_speed;
+    }
+}
+
+static uint8_t cpu_pack_flags(const struct cpu_core_t *cpu)
+{
+    return (cpu->flags.z_flag << 7) | (cpu->flags.n_flag << 6) | (cpu->flags.h_flag << 5) | (cpu->flags.c_flag << 4);
 }
 
 static void push_qq(struct gameboy_emulator_t *emulator)
 {
+    // qq = 3 is AF here, not SP as in the 16 bit register map. F is
+    // packed from the flag bits the instructions work on.
     struct cpu_core_t *cpu = (struct cpu_core_t*) &emulator->cpu;
     uint8_t reg_index = (emulator->opcode >> 0x04) & 0x03;
-    uint16_t data =  *(cpu->reg.cpu_16_bit_reg_map[reg_index]);
+    uint16_t data = reg_index == 0x03 ? (cpu->reg.af.high << 0x08) | cpu_pack_flags(cpu)
+                                      : *(cpu->reg.cpu_16_bit_reg_map[reg_index]);
 
-    write_16_bit_to_memory(emulator, data, cpu->reg.sp.data);
     cpu->reg.sp.data = cpu->reg.sp.data - 2;
+    write_16_bit_to_memory(emulator, data, cpu->reg.sp.data);
 }
 
 static void ld_nn_sp(struct gameboy_emulator_t *emulator)
@@ -676,18 +932,29 @@ static void ld_nn_sp(struct gameboy_emulator_t *emulator)
 
 static void pop_qq(struct gameboy_emulator_t *emulator)
 {
+    // POP AF unpacks F into the flag bits; its low nibble reads as zero.
     struct cpu_core_t *cpu = (struct cpu_core_t*) &emulator->cpu;
     uint8_t reg_index = (emulator->opcode >> 0x04) & 0x03;
-    
+    uint16_t data = read_16_bit_from_memory(emulator, cpu->reg.sp.data);
+
+    if (reg_index == 0x03)
+    {
+        cpu->reg.af.high = data >> 0x08;
+        cpu->reg.af.low = data & 0xf0;
+        cpu->flags.z_flag = (data >> 0x07) & 0x01;
+        cpu->flags.n_flag = (data >> 0x06) & 0x01;
+        cpu->flags.h_flag = (data >> 0x05) & 0x01;
+        cpu->flags.c_flag = (data >> 0x04) & 0x01;
+    }
+    else *(cpu->reg.cpu_16_bit_reg_map[reg_index]) = data;
     cpu->reg.sp.data = cpu->reg.sp.data + 2;
-    *(cpu->reg.cpu_16_bit_reg_map[reg_index]) = read_16_bit_from_memory(emulator, cpu->reg.sp.data);
 }
 
 static void ret(struct gameboy_emulator_t *emulator)
 {
     struct cpu_core_t *cpu = (struct cpu_core_t*) &emulator->cpu;
-    cpu->reg.sp.data = cpu->reg.sp.data + 2;
     cpu->reg.pc.data = read_16_bit_from_memory(emulator, cpu->reg.sp.data);
+    cpu->reg.sp.data = cpu->reg.sp.data + 2;
 }
 
 static void ret_cc(struct gameboy_emulator_t *emulator)
@@ -700,411 +967,6040 @@ static void ret_cc(struct gameboy_emulator_t *emulator)
         case 0xd0: should_jump = !emulator->cpu.flags.c_flag; break;
         case 0xd8: should_jump = emulator->cpu.flags.c_flag;  break;
     }
-    if (should_jump) ret(emulator);
+    if (should_jump)
+    {
+        ret(emulator);
+        emulator->cycles += 12 >> emulator->cgb.double_speed;
+    }
 }
 
-static void emulator_initialize(struct gameboy_emulator_t *emulator)
+// Audio processing unit
+//
+// Channels are not clocked along with the CPU. They are synthesized in
+// batches up to the current clock whenever a sound register is
+// written, the frame sequencer ticks or a frame ends, so parameters
+// are constant within a batch. Every change of a channel's output
+// level goes into a band-limited step buffer (windowed sinc) at the
+// host sample rate, which is integrated and handed to a lock-free
+// audio ring at the end of every frame.
+// For more details: https://gbdev.io/pandocs/Audio_details.html
+#define CPU_CLOCK               4194304
+#define APU_SEQUENCER_CLOCKS    8192
+#define APU_FLUSH_CLOCKS        65536
+#define APU_MAX_SAMPLE_RATE     192000
+#define APU_OUTPUT_SCALE        64.0f
+#define APU_HIGHPASS            0.001f
+
+#define BLIP_TAPS               16
+#define BLIP_PHASE_BITS         5
+#define BLIP_PHASES             (1 << BLIP_PHASE_BITS)
+#define BLIP_BUFFER_SIZE        4096
+#define BLIP_PI                 3.14159265358979323846
+
+struct audio_ring_t {
+    // Single producer, single consumer. The emulation thread writes
+    // and never waits: frames that do not fit are counted and dropped.
+    int16_t *frames;                // Interleaved left, right.
+    uint32_t capacity;              // In frames, a power of two.
+    _Atomic uint32_t head;          // Advanced by the producer only.
+    _Atomic uint32_t tail;          // Advanced by the consumer only.
+    _Atomic uint32_t overruns;
+    _Atomic uint32_t underruns;
+};
+
+struct audio_output_t {
+    struct audio_ring_t *ring;
+    uint32_t sample_rate;
+    // Output samples per clock, 32.32 fixed point.
+    uint64_t factor;
+    // Clock and sub-sample offset of deltas[][0].
+    uint64_t base_clock;
+    uint64_t offset;
+    float deltas[2][BLIP_BUFFER_SIZE + BLIP_TAPS];
+    float integrator[2];
+    float highpass[2];
+    // Integrated samples on their way into the ring, interleaved.
+    int16_t frames[BLIP_BUFFER_SIZE * 2];
+};
+
+static const uint8_t apu_duty_patterns[4] = { 0x01, 0x81, 0x87, 0x7e };
+static const uint8_t apu_noise_divisors[8] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+static float blip_kernel[BLIP_PHASES][BLIP_TAPS];
+
+int audio_ring_initialize(struct audio_ring_t *ring, uint32_t capacity)
 {
-    // Initialize CPU registers and flags. 
-    // For more details: http://bgb.bircd.org/pandocs.htm#powerupsequence
-    emulator->cpu.reg.pc.data = 0x0000;
-    emulator->cpu.reg.sp.data = 0xfffe;
-#if  defined(__GB__) || defined(__SGB__)
-    emulator->cpu.reg.af.data = 0x01b0;
-#else
-    #error "[Config] error - unknown emulation platform (either GB or SGB)."
-#endif
-    emulator->cpu.reg.bc.data = 0x0013;
-    emulator->cpu.reg.de.data = 0x00d8;
-    emulator->cpu.reg.hl.data = 0x014d;
-    emulator->cpu.tag = "SM83";
-    
-    // Map 8 bit registers
-    emulator->cpu.reg.cpu_8_bit_reg_map[0x00] = &emulator->cpu.reg.bc.high;     // Register B
-    emulator->cpu.reg.cpu_8_bit_reg_map[0x01] = &emulator->cpu.reg.bc.low;      // Register C
-    emulator->cpu.reg.cpu_8_bit_reg_map[0x02] = &emulator->cpu.reg.de.high;     // Register D
-    emulator->cpu.reg.cpu_8_bit_reg_map[0x03] = &emulator->cpu.reg.de.low;      // Register E
-    emulator->cpu.reg.cpu_8_bit_reg_map[0x04] = &emulator->cpu.reg.hl.high;     // Register H
-    emulator->cpu.reg.cpu_8_bit_reg_map[0x05] = &emulator->cpu.reg.hl.low;      // Register L
-    emulator->cpu.reg.cpu_8_bit_reg_map[0x06] = NULL;                           // Not mapped
-    emulator->cpu.reg.cpu_8_bit_reg_map[0x07] = &emulator->cpu.reg.af.high;     // Register A
+    uint32_t size = 1;
 
-    // Map 16 bit registers
-    emulator->cpu.reg.cpu_16_bit_reg_map[0x00] = &emulator->cpu.reg.bc.data;     // Register BC
-    emulator->cpu.reg.cpu_16_bit_reg_map[0x01] = &emulator->cpu.reg.de.data;     // Register DE
-    emulator->cpu.reg.cpu_16_bit_reg_map[0x02] = &emulator->cpu.reg.hl.data;     // Register HL
-    emulator->cpu.reg.cpu_16_bit_reg_map[0x03] = &emulator->cpu.reg.sp.data;     // Register SP
+    while (size < capacity) size <<= 1;
+    ring->frames = calloc(size * 2, sizeof(int16_t));
+    ring->capacity = size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->overruns, 0);
+    atomic_init(&ring->underruns, 0);
+    return ring->frames ? 0 : -1;
+}
 
-    // Initialize memory and in-memory registers. 
-    // For more details: http://bgb.bircd.org/pandocs.htm#powerupsequence
-    emulator->memory.size = MAIN_MEORY_SIZE;
-    memset(emulator->memory.blocks, 0, emulator->memory.size);
-    memcpy(emulator->memory.rom, boot_rom, 0x0100);
+uint32_t audio_ring_write(struct audio_ring_t *ring, const int16_t *frames, uint32_t count)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t space = ring->capacity - (head - tail);
+    uint32_t start = head & (ring->capacity - 1);
+    uint32_t first;
 
-    emulator->memory.blocks[0xff05] = 0x00;
-    emulator->memory.blocks[0xff06] = 0x00;
-    emulator->memory.blocks[0xff07] = 0x00;
-    emulator->memory.blocks[0xff10] = 0x80;
-    emulator->memory.blocks[0xff11] = 0xbf;
-    emulator->memory.blocks[0xff12] = 0xf3;
-    emulator->memory.blocks[0xff14] = 0xbf;
-    emulator->memory.blocks[0xff16] = 0x3f;
-    emulator->memory.blocks[0xff17] = 0x00;
-    emulator->memory.blocks[0xff19] = 0xbf;
-    emulator->memory.blocks[0xff1a] = 0x7f;
-    emulator->memory.blocks[0xff1b] = 0xff;
-    emulator->memory.blocks[0xff1c] = 0x9f;
-    emulator->memory.blocks[0xff1e] = 0xbf;
-    emulator->memory.blocks[0xff20] = 0xff;
-    emulator->memory.blocks[0xff21] = 0x00;
-    emulator->memory.blocks[0xff22] = 0x00;
-    emulator->memory.blocks[0xff23] = 0xbf;
-    emulator->memory.blocks[0xff24] = 0x77;
-    emulator->memory.blocks[0xff25] = 0xf3;
-#ifdef __GB__
-    emulator->memory.blocks[0xff26] = 0xf1;
-#elif __SGB__
-    emulator->memory.blocks[0xff26] = 0xf0;
-#else
-    #error "[Config] error - unknown emulation platform (either GB or SGB)."
-#endif
-    emulator->memory.blocks[0xff40] = 0x91;
-    emulator->memory.blocks[0xff42] = 0x00;
-    emulator->memory.blocks[0xff43] = 0x00;
-    emulator->memory.blocks[0xff45] = 0x00;
-    emulator->memory.blocks[0xff47] = 0xfc;
-    emulator->memory.blocks[0xff48] = 0xff;
-    emulator->memory.blocks[0xff49] = 0xff;
-    emulator->memory.blocks[0xff4a] = 0x00;
-    emulator->memory.blocks[0xff4b] = 0x00;
+    if (count > space)
+    {
+        atomic_fetch_add_explicit(&ring->overruns, count - space, memory_order_relaxed);
+        count = space;
+    }
+    first = count < ring->capacity - start ? count : ring->capacity - start;
+    memcpy(&ring->frames[start * 2], frames, first * 2 * sizeof(int16_t));
+    memcpy(ring->frames, &frames[first * 2], (count - first) * 2 * sizeof(int16_t));
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    return count;
 }
 
-void dum_cpu_registers(struct gameboy_emulator_t *emulator)
+uint32_t audio_ring_available(struct audio_ring_t *ring)
 {
-    printf("[INFO ] Register dumps\n");
-    printf("A = %2xh,\t",   emulator->cpu.reg.af.high);
-    printf("B = %2xh,\t",   emulator->cpu.reg.bc.high);
-    printf("D = %2xh,\t",   emulator->cpu.reg.de.high);
-    printf("H = %2xh\n",    emulator->cpu.reg.hl.high);
-    printf("- = %2xh,\t",   emulator->cpu.reg.af.low);
-    printf("C = %2xh,\t",   emulator->cpu.reg.bc.low);
-    printf("E = %2xh,\t",   emulator->cpu.reg.de.low);
-    printf("L = %2xh\n\n",  emulator->cpu.reg.hl.low);
-    printf("PC= %2xh,\t",   emulator->cpu.reg.pc.data);
-    printf("SP= %2xh\n\n",  emulator->cpu.reg.sp.data);
-    printf("Z = %2xh,\t",   emulator->cpu.flags.z_flag);
-    printf("N = %2xh,\t",   emulator->cpu.flags.n_flag);
-    printf("H = %2xh,\t",   emulator->cpu.flags.h_flag);
-    printf("C = %2xh\n",    emulator->cpu.flags.c_flag);
-    printf("[INFO ] End\n\n");
+    return atomic_load_explicit(&ring->head, memory_order_acquire) - atomic_load_explicit(&ring->tail, memory_order_relaxed);
 }
 
-void cpu_step_emulator(struct gameboy_emulator_t *emulator)
+uint32_t audio_ring_read(struct audio_ring_t *ring, int16_t *frames, uint32_t count)
 {
-    emulator->opcode = read_8_bit_immed_data_from_memory(emulator);
-    printf("[DEBUG] Executing opcode = $%x\n", emulator->opcode);
-    switch (emulator->opcode) 
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t available = head - tail;
+    uint32_t start = tail & (ring->capacity - 1);
+    uint32_t first;
+
+    if (count > available)
     {
-        // http://gcc.gnu.org/onlinedocs/gcc/Statements-implementation.html#Statements-implementation
-        // Opcodes - https://gbdev.io/gb-opcodes/optables/
-        // 8-bit transer abd input/output instructions
-        case 0x7e:
-        case 0x46:
-        case 0x4e:
-        case 0x56:
-        case 0x5e:
-        case 0x66:
-        case 0x6e:
-            load_r_hl(emulator);
-            break;
-        case 0x06:
-        case 0x0e:
-        case 0x16:
-        case 0x1e:
-        case 0x26:
-        case 0x2e:
-        case 0x3e:
-            load_r_n(emulator);
-            break;
-        case 0x7f:              // LD A, r'
-        case 0x78 ... 0x7d:
-        case 0x40 ... 0x45:     // LD B, r'
-        case 0x47:
-        case 0x48:              // LD C, r'
-        case 0x49:
-        case 0x4f:
-        case 0x4a ... 0x4d:
-        case 0x50 ... 0x55:     // LD D, r'
-        case 0x57:
-        case 0x58:              // LD E, r'
-        case 0x59:
-        case 0x5a ... 0x5d:
-        case 0x60 ... 0x65:     // LD H, r'
-        case 0x67:
-        case 0x68:              // LD L, r'
-        case 0x69:
-        case 0x6a ... 0x6d:
-            load_r_r(emulator);
-            break;
-        case 0x70 ... 0x75:     // LD (HL), r'
-        case 0x77:
-            load_hl_r(emulator);
-            break;
-        case 0x36:
-            load_hl_n(emulator);
-            break;
-        case 0x0a:
-            load_r_immed_data(emulator, 0x07, emulator->cpu.reg.bc.data);
-            break;
-        case 0x1a:
-            load_r_immed_data(emulator, 0x07, emulator->cpu.reg.de.data);
-            break;
-        case 0xf2: 
+        atomic_fetch_add_explicit(&ring->underruns, 1, memory_order_relaxed);
+        count = available;
+    }
+    first = count < ring->capacity - start ? count : ring->capacity - start;
+    memcpy(frames, &ring->frames[start * 2], first * 2 * sizeof(int16_t));
+    memcpy(&frames[first * 2], ring->frames, (count - first) * 2 * sizeof(int16_t));
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+    return count;
+}
+
+static double blip_sin(double x)
+{
+    // Taylor series after range reduction, to keep the build free of -lm.
+    double term, sum;
+    int i;
+
+    while (x > BLIP_PI) x -= 2 * BLIP_PI;
+    while (x < -BLIP_PI) x += 2 * BLIP_PI;
+    term = sum = x;
+    for (i = 1; i < 12; i++)
+    {
+        term *= -x * x / ((2 * i) * (2 * i + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+static void blip_initialize_kernel(void)
+{
+    // Blackman windowed sinc, cut off a little below Nyquist, for
+    // each sub-sample phase and normalized so a step keeps its height.
+    static uint8_t ready;
+    int phase, tap;
+
+    if (ready) return;
+    for (phase = 0; phase < BLIP_PHASES; phase++)
+    {
+        double sum = 0.0;
+        for (tap = 0; tap < BLIP_TAPS; tap++)
         {
-            uint16_t addr = 0xff00 + emulator->cpu.reg.bc.low;
-            load_r_immed_data(emulator, 0x07, addr);
+            double x = tap - (BLIP_TAPS / 2 - 1) - (double) phase / BLIP_PHASES;
+            double n = x / BLIP_TAPS + 0.5;
+            double sinc = x == 0.0 ? 0.9 : blip_sin(BLIP_PI * 0.9 * x) / (BLIP_PI * x);
+            double window = 0.42 - 0.5 * blip_sin(2 * BLIP_PI * n + BLIP_PI / 2) + 0.08 * blip_sin(4 * BLIP_PI * n + BLIP_PI / 2);
+            blip_kernel[phase][tap] = sinc * window;
+            sum += sinc * window;
+        }
+        for (tap = 0; tap < BLIP_TAPS; tap++) blip_kernel[phase][tap] /= sum;
+    }
+    ready = 1;
+}
+
+static void blip_add_delta(struct audio_output_t *output, int side, uint64_t clock, float delta)
+{
+    uint64_t position = (clock - output->base_clock) * output->factor + output->offset;
+    const float *kernel = blip_kernel[(position >> (32 - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)];
+    float *deltas = &output->deltas[side][position >> 32];
+    int tap;
+
+    for (tap = 0; tap < BLIP_TAPS; tap++) deltas[tap] += delta * kernel[tap];
+}
+
+static void apu_update_level(struct gameboy_emulator_t *emulator, int n, uint64_t clock)
+{
+    struct apu_channel_t *channel = &emulator->apu.channel[n];
+    uint8_t nr50 = emulator->apu.nr50;
+    uint8_t nr51 = emulator->apu.nr51;
+    int16_t left  = ((nr51 >> (n + 4)) & 0x01) ? channel->output * (((nr50 >> 4) & 0x07) + 1) : 0;
+    int16_t right = ((nr51 >> n) & 0x01) ? channel->output * ((nr50 & 0x07) + 1) : 0;
+
+    if (emulator->apu.output)
+    {
+        if (left != channel->level_left) blip_add_delta(emulator->apu.output, 0, clock, (left - channel->level_left) * APU_OUTPUT_SCALE);
+        if (right != channel->level_right) blip_add_delta(emulator->apu.output, 1, clock, (right - channel->level_right) * APU_OUTPUT_SCALE);
+    }
+    channel->level_left = left;
+    channel->level_right = right;
+}
+
+static uint8_t apu_channel_output(struct gameboy_emulator_t *emulator, int n)
+{
+    struct apu_channel_t *channel = &emulator->apu.channel[n];
+
+    if (!channel->enabled) return 0;
+    switch (n)
+    {
+        case 0:
+        case 1:
+            return ((apu_duty_patterns[channel->duty] >> (channel->position & 0x07)) & 0x01) ? channel->volume : 0;
+        case 2:
+        {
+            uint8_t sample = emulator->memory.blocks[0xff30 + (channel->position >> 1)];
+            sample = (channel->position & 0x01) ? sample & 0x0f : sample >> 4;
+            return sample >> channel->wave_shift;
+        }
+        default:
+            return (~channel->lfsr & 0x01) ? channel->volume : 0;
+    }
+}
+
+static void apu_set_output(struct gameboy_emulator_t *emulator, int n, uint64_t clock)
+{
+    emulator->apu.channel[n].output = apu_channel_output(emulator, n);
+    apu_update_level(emulator, n, clock);
+}
+
+static void apu_update_status(struct gameboy_emulator_t *emulator)
+{
+    uint8_t status = (emulator->memory.blocks[0xff26] & 0x80) | 0x70;
+    int n;
+
+    for (n = 0; n < 4; n++) status |= emulator->apu.channel[n].enabled << n;
+    emulator->memory.blocks[0xff26] = status;
+}
+
+static void apu_disable(struct gameboy_emulator_t *emulator, int n)
+{
+    emulator->apu.channel[n].enabled = 0;
+    apu_set_output(emulator, n, emulator->apu.clock);
+    apu_update_status(emulator);
+}
+
+static void apu_run_channel(struct gameboy_emulator_t *emulator, int n, uint64_t to)
+{
+    struct apu_channel_t *channel = &emulator->apu.channel[n];
+
+    if (!channel->enabled)
+    {
+        channel->next_step = to;
+        return;
+    }
+
+    while (channel->next_step < to)
+    {
+        if (n == 3)
+        {
+            uint16_t bit = (channel->lfsr ^ (channel->lfsr >> 1)) & 0x01;
+            channel->lfsr = (channel->lfsr >> 1) | (bit << 14);
+            if (channel->lfsr_width) channel->lfsr = (channel->lfsr & ~0x40) | (bit << 6);
+        }
+        else
+        {
+            channel->position = (channel->position + 1) & (n == 2 ? 0x1f : 0x07);
+        }
+        apu_set_output(emulator, n, channel->next_step);
+        channel->next_step += channel->period;
+    }
+}
+
+static void apu_flush(struct gameboy_emulator_t *emulator)
+{
+    // Integrates every complete output sample buffered so far and
+    // moves the kernel tails of later deltas to the buffer start.
+    struct audio_output_t *output = emulator->apu.output;
+    int16_t *frames = output->frames;
+    uint64_t position = (emulator->apu.clock - output->base_clock) * output->factor + output->offset;
+    uint32_t count = position >> 32;
+    uint32_t i;
+    int side;
+
+    for (side = 0; side < 2; side++)
+    {
+        float *deltas = output->deltas[side];
+        for (i = 0; i < count; i++)
+        {
+            float sample;
+            output->integrator[side] += deltas[i];
+            sample = output->integrator[side] - output->highpass[side];
+            output->highpass[side] += sample * APU_HIGHPASS;
+            if (sample > 32767.0f) sample = 32767.0f;
+            if (sample < -32768.0f) sample = -32768.0f;
+            frames[i * 2 + side] = (int16_t) sample;
+        }
+        memmove(deltas, &deltas[count], (BLIP_BUFFER_SIZE + BLIP_TAPS - count) * sizeof(float));
+        memset(&deltas[BLIP_BUFFER_SIZE + BLIP_TAPS - count], 0, count * sizeof(float));
+    }
+
+    output->base_clock = emulator->apu.clock;
+    output->offset = position & 0xffffffff;
+    if (output->ring) audio_ring_write(output->ring, frames, count);
+}
+
+static void apu_catch_up(struct gameboy_emulator_t *emulator, uint64_t clock)
+{
+    struct apu_t *apu = &emulator->apu;
+    struct audio_output_t *output = apu->output;
+    int n;
+
+    if (output == NULL)
+    {
+        if (clock > apu->clock) apu->clock = clock;
+        return;
+    }
+
+    while (apu->clock < clock)
+    {
+        uint64_t to = clock - output->base_clock > APU_FLUSH_CLOCKS ? output->base_clock + APU_FLUSH_CLOCKS : clock;
+        for (n = 0; n < 4; n++) apu_run_channel(emulator, n, to);
+        apu->clock = to;
+        if (to - output->base_clock >= APU_FLUSH_CLOCKS) apu_flush(emulator);
+    }
+}
+
+static uint16_t apu_frequency(struct gameboy_emulator_t *emulator, int n)
+{
+    uint16_t base = 0xff10 + n * 5;
+    return ((emulator->memory.blocks[base + 4] & 0x07) << 8) | emulator->memory.blocks[base + 3];
+}
+
+static void apu_update_period(struct gameboy_emulator_t *emulator, int n)
+{
+    struct apu_channel_t *channel = &emulator->apu.channel[n];
+    uint8_t nr43 = emulator->memory.blocks[0xff22];
+
+    switch (n)
+    {
+        case 0:
+        case 1: channel->period = (2048 - apu_frequency(emulator, n)) * 4; break;
+        case 2: channel->period = (2048 - apu_frequency(emulator, n)) * 2; break;
+        default:
+            channel->period = apu_noise_divisors[nr43 & 0x07] << (nr43 >> 4);
+            channel->lfsr_width = (nr43 >> 3) & 0x01;
+            break;
+    }
+}
+
+static uint16_t apu_sweep_next(struct gameboy_emulator_t *emulator)
+{
+    struct apu_channel_t *channel = &emulator->apu.channel[0];
+    uint8_t nr10 = emulator->memory.blocks[0xff10];
+    uint16_t delta = channel->sweep_frequency >> (nr10 & 0x07);
+
+    return (nr10 & 0x08) ? channel->sweep_frequency - delta : channel->sweep_frequency + delta;
+}
+
+static void apu_sweep(struct gameboy_emulator_t *emulator)
+{
+    struct apu_channel_t *channel = &emulator->apu.channel[0];
+    uint8_t nr10 = emulator->memory.blocks[0xff10];
+    uint8_t period = (nr10 >> 4) & 0x07;
+    uint16_t frequency;
+
+    if (--channel->sweep_timer) return;
+    channel->sweep_timer = period ? period : 8;
+    if (!channel->sweep_enable || !period) return;
+
+    frequency = apu_sweep_next(emulator);
+    if (frequency > 2047)
+    {
+        apu_disable(emulator, 0);
+        return;
+    }
+    if (nr10 & 0x07)
+    {
+        channel->sweep_frequency = frequency;
+        emulator->memory.blocks[0xff13] = frequency & 0xff;
+        emulator->memory.blocks[0xff14] = (emulator->memory.blocks[0xff14] & ~0x07) | (frequency >> 8);
+        apu_update_period(emulator, 0);
+        if (apu_sweep_next(emulator) > 2047) apu_disable(emulator, 0);
+    }
+}
+
+static void apu_envelope(struct gameboy_emulator_t *emulator, int n)
+{
+    struct apu_channel_t *channel = &emulator->apu.channel[n];
+    uint8_t nrx2 = emulator->memory.blocks[0xff12 + n * 5];
+
+    if (!(nrx2 & 0x07) || --channel->envelope_timer) return;
+    channel->envelope_timer = nrx2 & 0x07;
+    if ((nrx2 & 0x08) && channel->volume < 15) channel->volume++;
+    else if (!(nrx2 & 0x08) && channel->volume > 0) channel->volume--;
+    apu_set_output(emulator, n, emulator->apu.clock);
+}
+
+static void apu_sequencer(struct gameboy_emulator_t *emulator)
+{
+    // Length counters at 256 Hz, sweep at 128 Hz, envelopes at 64 Hz.
+    struct apu_t *apu = &emulator->apu;
+    uint8_t step = apu->sequencer_step;
+    int n;
+
+    apu->sequencer_step = (step + 1) & 0x07;
+    if (!apu->power) return;
+
+    if ((step & 0x01) == 0)
+    {
+        for (n = 0; n < 4; n++)
+        {
+            struct apu_channel_t *channel = &apu->channel[n];
+            if (channel->length_enable && channel->length && --channel->length == 0) apu_disable(emulator, n);
+        }
+    }
+    if (step == 2 || step == 6) apu_sweep(emulator);
+    if (step == 7)
+    {
+        apu_envelope(emulator, 0);
+        apu_envelope(emulator, 1);
+        apu_envelope(emulator, 3);
+    }
+}
+
+static void apu_trigger(struct gameboy_emulator_t *emulator, int n)
+{
+    struct apu_channel_t *channel = &emulator->apu.channel[n];
+    uint8_t nrx2 = emulator->memory.blocks[0xff12 + n * 5];
+
+    channel->enabled = channel->dac;
+    if (channel->length == 0) channel->length = n == 2 ? 256 : 64;
+    channel->next_step = emulator->apu.clock + channel->period;
+    channel->position = 0;
+    channel->volume = nrx2 >> 4;
+    channel->envelope_timer = nrx2 & 0x07;
+    channel->lfsr = 0x7fff;
+
+    if (n == 0)
+    {
+        uint8_t nr10 = emulator->memory.blocks[0xff10];
+        channel->sweep_frequency = apu_frequency(emulator, 0);
+        channel->sweep_timer = ((nr10 >> 4) & 0x07) ? ((nr10 >> 4) & 0x07) : 8;
+        channel->sweep_enable = (nr10 & 0x77) != 0;
+        if ((nr10 & 0x07) && apu_sweep_next(emulator) > 2047) channel->enabled = 0;
+    }
+
+    apu_set_output(emulator, n, emulator->apu.clock);
+    apu_update_status(emulator);
+}
+
+static void apu_write(struct gameboy_emulator_t *emulator, uint16_t addr)
+{
+    // Called after a write to $FF10-$FF3F has been stored.
+    struct apu_t *apu = &emulator->apu;
+    uint8_t value = emulator->memory.blocks[addr];
+    int n = (addr - 0xff10) / 5;
+    int i;
+
+    apu_catch_up(emulator, emulator->cycles);
+
+    if (addr == 0xff26)
+    {
+        if (!(value & 0x80))
+        {
+            for (i = 0xff10; i < 0xff26; i++) emulator->memory.blocks[i] = 0x00;
+            for (i = 0; i < 4; i++) apu->channel[i].enabled = 0;
+            for (i = 0; i < 4; i++) apu_set_output(emulator, i, apu->clock);
+        }
+        else if (!apu->power) apu->sequencer_step = 0;
+        apu->power = value >> 7;
+        apu_update_status(emulator);
+        return;
+    }
+    if (addr >= 0xff30) return;                             // Wave RAM
+    if (!apu->power)
+    {
+        emulator->memory.blocks[addr] = 0x00;               // Read only while powered off.
+        return;
+    }
+    if (addr > 0xff25) return;
+
+    switch (addr)
+    {
+        case 0xff24:
+            apu->nr50 = value;
+            for (i = 0; i < 4; i++) apu_update_level(emulator, i, apu->clock);
+            return;
+        case 0xff25:
+            apu->nr51 = value;
+            for (i = 0; i < 4; i++) apu_update_level(emulator, i, apu->clock);
+            return;
+        case 0xff1a:
+            apu->channel[2].dac = value >> 7;
+            if (!apu->channel[2].dac) apu_disable(emulator, 2);
+            return;
+        case 0xff1c:
+            apu->channel[2].wave_shift = ((value >> 5) & 0x03) ? ((value >> 5) & 0x03) - 1 : 4;
+            return;
+    }
+
+    switch ((addr - 0xff10) % 5)
+    {
+        case 1:     // NRx1 duty and length
+            apu->channel[n].duty = value >> 6;
+            apu->channel[n].length = n == 2 ? 256 - value : 64 - (value & 0x3f);
+            break;
+        case 2:     // NRx2 volume envelope
+            apu->channel[n].dac = (value & 0xf8) != 0;
+            if (!apu->channel[n].dac) apu_disable(emulator, n);
+            break;
+        case 3:     // NRx3 frequency low, NR43 polynomial counter
+            apu_update_period(emulator, n);
+            break;
+        case 4:     // NRx4 frequency high, length enable, trigger
+            apu_update_period(emulator, n);
+            apu->channel[n].length_enable = (value >> 6) & 0x01;
+            if (value & 0x80) apu_trigger(emulator, n);
             break;
+    }
+}
+
+static void apu_initialize(struct gameboy_emulator_t *emulator)
+{
+    // Picks up the channel state from the power up register values.
+    // Channel 1 is still enabled after the boot sound, but its
+    // envelope has faded out, so all channels start silent.
+    struct apu_t *apu = &emulator->apu;
+    uint8_t *io = &emulator->memory.blocks[0xff00];
+    int n;
+
+    memset(apu, 0, sizeof(*apu));
+    apu->next_tick = APU_SEQUENCER_CLOCKS;
+    apu->power = io[0x26] >> 7;
+    apu->nr50 = io[0x24];
+    apu->nr51 = io[0x25];
+    for (n = 0; n < 4; n++)
+    {
+        struct apu_channel_t *channel = &apu->channel[n];
+        channel->dac = n == 2 ? io[0x1a] >> 7 : (io[0x12 + n * 5] & 0xf8) != 0;
+        channel->enabled = channel->dac && ((io[0x26] >> n) & 0x01);
+        channel->duty = io[0x11 + n * 5] >> 6;
+        channel->lfsr = 0x7fff;
+        apu_update_period(emulator, n);
+    }
+    apu->channel[2].wave_shift = ((io[0x1c] >> 5) & 0x03) ? ((io[0x1c] >> 5) & 0x03) - 1 : 4;
+}
+
+void apu_attach_output(struct gameboy_emulator_t *emulator, struct audio_output_t *output,
+                       struct audio_ring_t *ring, uint32_t sample_rate)
+{
+    // Starts synthesis into ring. Pass output = NULL to mute again.
+    struct apu_t *apu = &emulator->apu;
+    int n;
+
+    apu_catch_up(emulator, emulator->cycles);
+    apu->output = output;
+    for (n = 0; n < 4; n++)
+    {
+        apu->channel[n].next_step = apu->clock;
+        apu->channel[n].level_left = 0;
+        apu->channel[n].level_right = 0;
+    }
+    if (output == NULL) return;
+
+    blip_initialize_kernel();
+    memset(output, 0, sizeof(*output));
+    if (sample_rate > APU_MAX_SAMPLE_RATE) sample_rate = APU_MAX_SAMPLE_RATE;
+    output->ring = ring;
+    output->sample_rate = sample_rate;
+    output->factor = ((uint64_t) sample_rate << 32) / CPU_CLOCK;
+    output->base_clock = apu->clock;
+    for (n = 0; n < 4; n++) apu_set_output(emulator, n, apu->clock);
+}
+
+void apu_step_emulator(struct gameboy_emulator_t *emulator)
+{
+    struct apu_t *apu = &emulator->apu;
+
+    while (emulator->cycles >= apu->next_tick)
+    {
+        apu_catch_up(emulator, apu->next_tick);
+        apu_sequencer(emulator);
+        apu->next_tick += APU_SEQUENCER_CLOCKS;
+    }
+}
+
+static void apu_end_frame(struct gameboy_emulator_t *emulator)
+{
+    apu_catch_up(emulator, emulator->cycles);
+    if (emulator->apu.output) apu_flush(emulator);
+}
+
+static void emulator_map_registers(struct gameboy_emulator_t *emulator)
+{
+    // Map 8 bit registers
+    emulator->cpu.reg.cpu_8_bit_reg_map[0x00] = &emulator->cpu.reg.bc.high;     // Register B
+    emulator->cpu.reg.cpu_8_bit_reg_map[0x01] = &emulator->cpu.reg.bc.low;      // Register C
+    emulator->cpu.reg.cpu_8_bit_reg_map[0x02] = &emulator->cpu.reg.de.high;     // Register D
+    emulator->cpu.reg.cpu_8_bit_reg_map[0x03] = &emulator->cpu.reg.de.low;      // Register E
+    emulator->cpu.reg.cpu_8_bit_reg_map[0x04] = &emulator->cpu.reg.hl.high;     // Register H
+    emulator->cpu.reg.cpu_8_bit_reg_map[0x05] = &emulator->cpu.reg.hl.low;      // Register L
+    emulator->cpu.reg.cpu_8_bit_reg_map[0x06] = NULL;                           // Not mapped
+    emulator->cpu.reg.cpu_8_bit_reg_map[0x07] = &emulator->cpu.reg.af.high;     // Register A
+
+    // Map 16 bit registers
+    emulator->cpu.reg.cpu_16_bit_reg_map[0x00] = &emulator->cpu.reg.bc.data;     // Register BC
+    emulator->cpu.reg.cpu_16_bit_reg_map[0x01] = &emulator->cpu.reg.de.data;     // Register DE
+    emulator->cpu.reg.cpu_16_bit_reg_map[0x02] = &emulator->cpu.reg.hl.data;     // Register HL
+    emulator->cpu.reg.cpu_16_bit_reg_map[0x03] = &emulator->cpu.reg.sp.data;     // Register SP
+}
+
+void emulator_initialize(struct gameboy_emulator_t *emulator)
+{
+    // Start from all zeroes, padding included, so that neither runs nor
+    // saved states depend on what the memory held before.
+    memset(emulator, 0, sizeof(*emulator));
+
+    // Initialize CPU registers and flags. __GB__ and __SGB__ pick the
+    // DMG flavour; CGB mode is set per cartridge by cgb_power_up().
+    // For more details: http://bgb.bircd.org/pandocs.htm#powerupsequence
+    emulator->cpu.reg.pc.data = 0x0000;
+    emulator->cpu.reg.sp.data = 0xfffe;
+#if  defined(__GB__) || defined(__SGB__)
+    emulator->cpu.reg.af.data = 0x01b0;
+#else
+    #error "[Config] error - unknown emulation platform (either GB or SGB)."
+#endif
+    emulator->cpu.reg.bc.data = 0x0013;
+    emulator->cpu.reg.de.data = 0x00d8;
+    emulator->cpu.reg.hl.data = 0x014d;
+    emulator->cpu.flags.z_flag = (emulator->cpu.reg.af.low >> 0x07) & 0x01;
+    emulator->cpu.flags.n_flag = (emulator->cpu.reg.af.low >> 0x06) & 0x01;
+    emulator->cpu.flags.h_flag = (emulator->cpu.reg.af.low >> 0x05) & 0x01;
+    emulator->cpu.flags.c_flag = (emulator->cpu.reg.af.low >> 0x04) & 0x01;
+    emulator->cpu.flags.not_used = 0;
+    emulator->cpu.tag = "SM83";
+    emulator->cycles = 0;
+    emulator->next_event = CLOCKS_PER_LINE;
+    emulator->slice_end = 0;
+    emulator->run_watch = 0;
+    emulator->ppu.line_start = 0;
+    emulator->ppu.frames = 0;
+    emulator->trace = 0;
+    emulator->profiler = NULL;
+    emulator->debugger = NULL;
+    
+    emulator_map_registers(emulator);
+
+    // Initialize memory and in-memory registers. 
+    // For more details: http://bgb.bircd.org/pandocs.htm#powerupsequence
+    emulator->memory.size = MAIN_MEORY_SIZE;
+    memset(emulator->memory.blocks, 0, emulator->memory.size);
+    memset(emulator->memory.cartridge_head, 0, sizeof(emulator->memory.cartridge_head));
+    memcpy(emulator->memory.rom, boot_rom, 0x0100);
+    emulator->memory.boot_rom_mapped = 1;
+    memory_update_page_traps(emulator);
+
+    emulator->memory.blocks[0xff00] = 0xcf;
+    emulator->joypad.lines = 0x0f;
+    emulator->memory.blocks[0xff05] = 0x00;
+    emulator->memory.blocks[0xff06] = 0x00;
+    emulator->memory.blocks[0xff07] = 0x00;
+    emulator->memory.blocks[0xff10] = 0x80;
+    emulator->memory.blocks[0xff11] = 0xbf;
+    emulator->memory.blocks[0xff12] = 0xf3;
+    emulator->memory.blocks[0xff14] = 0xbf;
+    emulator->memory.blocks[0xff16] = 0x3f;
+    emulator->memory.blocks[0xff17] = 0x00;
+    emulator->memory.blocks[0xff19] = 0xbf;
+    emulator->memory.blocks[0xff1a] = 0x7f;
+    emulator->memory.blocks[0xff1b] = 0xff;
+    emulator->memory.blocks[0xff1c] = 0x9f;
+    emulator->memory.blocks[0xff1e] = 0xbf;
+    emulator->memory.blocks[0xff20] = 0xff;
+    emulator->memory.blocks[0xff21] = 0x00;
+    emulator->memory.blocks[0xff22] = 0x00;
+    emulator->memory.blocks[0xff23] = 0xbf;
+    emulator->memory.blocks[0xff24] = 0x77;
+    emulator->memory.blocks[0xff25] = 0xf3;
+#ifdef __GB__
+    emulator->memory.blocks[0xff26] = 0xf1;
+#elif __SGB__
+    emulator->memory.blocks[0xff26] = 0xf0;
+#else
+    #error "[Config] error - unknown emulation platform (either GB or SGB)."
+#endif
+    emulator->memory.blocks[0xff40] = 0x91;
+    emulator->memory.blocks[0xff42] = 0x00;
+    emulator->memory.blocks[0xff43] = 0x00;
+    emulator->memory.blocks[0xff45] = 0x00;
+    emulator->memory.blocks[0xff47] = 0xfc;
+    emulator->memory.blocks[0xff48] = 0xff;
+    emulator->memory.blocks[0xff49] = 0xff;
+    emulator->memory.blocks[0xff4a] = 0x00;
+    emulator->memory.blocks[0xff4b] = 0x00;
+
+    apu_initialize(emulator);
+}
+
+static void emulator_load_rom_data(struct gameboy_emulator_t *emulator, const uint8_t *data, size_t size)
+{
+    // Loads a cartridge without a memory bank controller. The first
+    // 256 bytes stay hidden under the boot ROM until it unmaps itself.
+    // Bit 7 of the CGB flag at $0143 selects CGB mode.
+    if (size > 0x0143 && (data[0x0143] & 0x80)) cgb_power_up(emulator);
+    if (size > ROM_SIZE) size = ROM_SIZE;
+    memcpy(emulator->memory.cartridge_head, data, size < 0x0100 ? size : 0x0100);
+    if (size > 0x0100) memcpy(&emulator->memory.rom[0x0100], &data[0x0100], size - 0x0100);
+    if (!emulator->memory.boot_rom_mapped) memcpy(emulator->memory.rom, emulator->memory.cartridge_head, 0x0100);
+}
+
+int emulator_load_rom(struct gameboy_emulator_t *emulator, const char *path)
+{
+    static uint8_t data[ROM_SIZE];
+    FILE *file = fopen(path, "rb");
+    size_t size;
+
+    if (file == NULL)
+    {
+        printf("[ERROR] Cannot open ROM %s.\n", path);
+        return -1;
+    }
+
+    size = fread(data, 1, ROM_SIZE, file);
+    if (fgetc(file) != EOF) printf("[WARN ] ROM %s is larger than %d bytes, banks are not supported.\n", path, ROM_SIZE);
+    fclose(file);
+
+    emulator_load_rom_data(emulator, data, size);
+    return 0;
+}
+
+void dum_cpu_registers(struct gameboy_emulator_t *emulator)
+{
+    printf("[INFO ] Register dumps\n");
+    printf("A = %2xh,\t",   emulator->cpu.reg.af.high);
+    printf("B = %2xh,\t",   emulator->cpu.reg.bc.high);
+    printf("D = %2xh,\t",   emulator->cpu.reg.de.high);
+    printf("H = %2xh\n",    emulator->cpu.reg.hl.high);
+    printf("- = %2xh,\t",   emulator->cpu.reg.af.low);
+    printf("C = %2xh,\t",   emulator->cpu.reg.bc.low);
+    printf("E = %2xh,\t",   emulator->cpu.reg.de.low);
+    printf("L = %2xh\n\n",  emulator->cpu.reg.hl.low);
+    printf("PC= %2xh,\t",   emulator->cpu.reg.pc.data);
+    printf("SP= %2xh\n\n",  emulator->cpu.reg.sp.data);
+    printf("Z = %2xh,\t",   emulator->cpu.flags.z_flag);
+    printf("N = %2xh,\t",   emulator->cpu.flags.n_flag);
+    printf("H = %2xh,\t",   emulator->cpu.flags.h_flag);
+    printf("C = %2xh\n",    emulator->cpu.flags.c_flag);
+    printf("[INFO ] End\n\n");
+}
+
+struct cpu_state_t {
+    // Registers as a test harness or debugger front end sees them:
+    // F as one byte, and IE along with them.
+    uint16_t pc;
+    uint16_t sp;
+    uint8_t a, f, b, c, d, e, h, l;
+    uint8_t ie;
+};
+
+void emulator_inject_state(struct gameboy_emulator_t *emulator, const struct cpu_state_t *state)
+{
+    // Sets the CPU registers. F is split into the flag bits the
+    // instructions work on; its low nibble always reads as zero.
+    emulator->cpu.reg.pc.data = state->pc;
+    emulator->cpu.reg.sp.data = state->sp;
+    emulator->cpu.reg.af.high = state->a;
+    emulator->cpu.reg.af.low = state->f & 0xf0;
+    emulator->cpu.reg.bc.high = state->b;
+    emulator->cpu.reg.bc.low = state->c;
+    emulator->cpu.reg.de.high = state->d;
+    emulator->cpu.reg.de.low = state->e;
+    emulator->cpu.reg.hl.high = state->h;
+    emulator->cpu.reg.hl.low = state->l;
+    emulator->cpu.flags.z_flag = (state->f >> 0x07) & 0x01;
+    emulator->cpu.flags.n_flag = (state->f >> 0x06) & 0x01;
+    emulator->cpu.flags.h_flag = (state->f >> 0x05) & 0x01;
+    emulator->cpu.flags.c_flag = (state->f >> 0x04) & 0x01;
+    emulator->memory.blocks[0xffff] = state->ie;
+}
+
+void emulator_extract_state(const struct gameboy_emulator_t *emulator, struct cpu_state_t *state)
+{
+    state->pc = emulator->cpu.reg.pc.data;
+    state->sp = emulator->cpu.reg.sp.data;
+    state->a = emulator->cpu.reg.af.high;
+    state->f = cpu_pack_flags(&emulator->cpu);
+    state->b = emulator->cpu.reg.bc.high;
+    state->c = emulator->cpu.reg.bc.low;
+    state->d = emulator->cpu.reg.de.high;
+    state->e = emulator->cpu.reg.de.low;
+    state->h = emulator->cpu.reg.hl.high;
+    state->l = emulator->cpu.reg.hl.low;
+    state->ie = emulator->memory.blocks[0xffff];
+}
+
+// Execution profiler
+//
+// Counts every executed opcode and CB opcode, and keeps hit and clock
+// counters per address in flat arrays indexed by bank:address, plus
+// a bitmap of executed addresses for coverage. A shadow call stack,
+// followed through CALL and RET, attributes clocks to call paths for
+// flamegraph style folded stacks. The dispatch loop only pays for a
+// NULL check while no profiler is attached.
+#define PROFILE_BANKS           1
+#define PROFILE_ADDRESSES       (PROFILE_BANKS << 16)
+#define PROFILE_STACK_DEPTH     16
+#define PROFILE_STACKS          4096
+
+struct profile_stack_t {
+    uint16_t frames[PROFILE_STACK_DEPTH];
+    uint8_t depth;
+    uint64_t cycles;
+};
+
+struct profiler_t {
+    uint64_t instructions;
+    uint64_t opcode_hits[0x100];
+    uint64_t cb_opcode_hits[0x100];
+    uint64_t pc_hits[PROFILE_ADDRESSES];
+    uint64_t pc_cycles[PROFILE_ADDRESSES];
+    uint8_t coverage[PROFILE_ADDRESSES / 8];
+
+    uint16_t call_stack[PROFILE_STACK_DEPTH];
+    uint8_t call_depth;
+    // Calls made past PROFILE_STACK_DEPTH, so their returns match up.
+    uint32_t call_overflow;
+    uint32_t current_stack;
+    uint32_t dropped_stacks;
+    struct profile_stack_t stacks[PROFILE_STACKS];
+};
+
+static uint8_t profiler_bank(struct gameboy_emulator_t *emulator, uint16_t pc)
+{
+    // There is no memory bank controller yet, every address maps to
+    // bank 0. Counters keep the bank in their index regardless.
+    return 0;
+}
+
+static uint32_t profiler_stack_slot(struct profiler_t *profiler)
+{
+    uint32_t hash = 2166136261u;
+    uint32_t probe;
+    uint8_t i;
+
+    for (i = 0; i < profiler->call_depth; i++)
+        hash = (hash ^ profiler->call_stack[i]) * 16777619u;
+
+    for (probe = 0; probe < PROFILE_STACKS; probe++)
+    {
+        uint32_t slot = (hash + probe) & (PROFILE_STACKS - 1);
+        struct profile_stack_t *stack = &profiler->stacks[slot];
+
+        if (stack->depth == 0)
+        {
+            memcpy(stack->frames, profiler->call_stack, sizeof(stack->frames));
+            stack->depth = profiler->call_depth;
+            return slot;
+        }
+        if (stack->depth == profiler->call_depth &&
+            memcmp(stack->frames, profiler->call_stack, stack->depth * sizeof(uint16_t)) == 0)
+            return slot;
+    }
+    profiler->dropped_stacks++;
+    return PROFILE_STACKS;
+}
+
+void profiler_attach(struct gameboy_emulator_t *emulator, struct profiler_t *profiler)
+{
+    memset(profiler, 0, sizeof(*profiler));
+    profiler->call_stack[0] = emulator->cpu.reg.pc.data;
+    profiler->call_depth = 1;
+    profiler->current_stack = profiler_stack_slot(profiler);
+    emulator->profiler = profiler;
+}
+
+static void profiler_record(struct gameboy_emulator_t *emulator, uint16_t pc, uint16_t sp, uint64_t cycles)
+{
+    struct profiler_t *profiler = emulator->profiler;
+    uint32_t index = ((uint32_t) profiler_bank(emulator, pc) << 16) | pc;
+    uint64_t spent = emulator->cycles - cycles;
+    uint8_t opcode = emulator->opcode;
+
+    profiler->instructions++;
+    profiler->opcode_hits[opcode]++;
+    if (opcode == 0xcb) profiler->cb_opcode_hits[emulator->memory.blocks[(uint16_t) (pc + 1)]]++;
+    profiler->pc_hits[index]++;
+    profiler->pc_cycles[index] += spent;
+    profiler->coverage[index >> 3] |= 1 << (index & 0x07);
+    if (profiler->current_stack < PROFILE_STACKS) profiler->stacks[profiler->current_stack].cycles += spent;
+
+    switch (opcode)
+    {
+        case 0xcd:
+        case 0xc4:
+        case 0xcc:
+        case 0xd4:
+        case 0xdc:
+            if (emulator->cpu.reg.sp.data != (uint16_t) (sp - 2)) break;   // Not taken.
+            if (profiler->call_depth == PROFILE_STACK_DEPTH)
+            {
+                profiler->call_overflow++;
+                break;
+            }
+            profiler->call_stack[profiler->call_depth++] = emulator->cpu.reg.pc.data;
+            profiler->current_stack = profiler_stack_slot(profiler);
+            break;
+        case 0xc9:
+        case 0xc0:
+        case 0xc8:
+        case 0xd0:
+        case 0xd8:
+            if (emulator->cpu.reg.sp.data != (uint16_t) (sp + 2)) break;   // Not taken.
+            if (profiler->call_overflow)
+            {
+                profiler->call_overflow--;
+                break;
+            }
+            if (profiler->call_depth > 1) profiler->call_depth--;
+            profiler->current_stack = profiler_stack_slot(profiler);
+            break;
+    }
+}
+
+static const uint64_t *profile_sort_key;
+
+static int compare_profile_index(const void *a, const void *b)
+{
+    uint64_t x = profile_sort_key[*(const uint32_t*) a];
+    uint64_t y = profile_sort_key[*(const uint32_t*) b];
+    return (x < y) - (x > y);
+}
+
+void profiler_write_flat(struct profiler_t *profiler, FILE *out)
+{
+    static uint32_t order[PROFILE_ADDRESSES];
+    uint64_t total = 0;
+    uint32_t count = 0;
+    uint32_t i;
+
+    for (i = 0; i < PROFILE_ADDRESSES; i++)
+    {
+        total += profiler->pc_cycles[i];
+        if (profiler->pc_hits[i]) order[count++] = i;
+    }
+    profile_sort_key = profiler->pc_cycles;
+    qsort(order, count, sizeof(order[0]), compare_profile_index);
+
+    fprintf(out, "# %llu instructions, %llu clocks, %u addresses executed\n",
+            (unsigned long long) profiler->instructions, (unsigned long long) total, count);
+    fprintf(out, "# bank:addr       hits     clocks  %%clocks\n");
+    for (i = 0; i < count; i++)
+    {
+        uint32_t index = order[i];
+        fprintf(out, "%02x:%04x %12llu %10llu %8.2f\n", index >> 16, index & 0xffff,
+                (unsigned long long) profiler->pc_hits[index],
+                (unsigned long long) profiler->pc_cycles[index],
+                total ? profiler->pc_cycles[index] * 100.0 / total : 0.0);
+    }
+
+    fprintf(out, "\n# opcode       hits\n");
+    for (i = 0; i < 0x100; i++)
+        if (profiler->opcode_hits[i]) fprintf(out, "%02x %15llu\n", i, (unsigned long long) profiler->opcode_hits[i]);
+    fprintf(out, "\n# cb opcode    hits\n");
+    for (i = 0; i < 0x100; i++)
+        if (profiler->cb_opcode_hits[i]) fprintf(out, "cb%02x %13llu\n", i, (unsigned long long) profiler->cb_opcode_hits[i]);
+}
+
+void profiler_write_folded(struct profiler_t *profiler, FILE *out)
+{
+    // One line per call path: "00:0000;00:0095;00:0096 <clocks>", the
+    // input format of flamegraph.pl and compatible tools.
+    uint32_t slot;
+    uint8_t i;
+
+    for (slot = 0; slot < PROFILE_STACKS; slot++)
+    {
+        struct profile_stack_t *stack = &profiler->stacks[slot];
+        if (stack->depth == 0 || stack->cycles == 0) continue;
+        for (i = 0; i < stack->depth; i++)
+            fprintf(out, "%s%02x:%04x", i ? ";" : "", profiler_bank(NULL, stack->frames[i]), stack->frames[i]);
+        fprintf(out, " %llu\n", (unsigned long long) stack->cycles);
+    }
+}
+
+void profiler_write_coverage(struct profiler_t *profiler, FILE *out)
+{
+    // Executed address ranges, inclusive, one per line.
+    uint32_t i = 0;
+
+    while (i < PROFILE_ADDRESSES)
+    {
+        uint32_t start;
+        if (!(profiler->coverage[i >> 3] & (1 << (i & 0x07)))) { i++; continue; }
+        start = i;
+        while (i < PROFILE_ADDRESSES && (profiler->coverage[i >> 3] & (1 << (i & 0x07)))) i++;
+        fprintf(out, "%02x:%04x-%04x\n", start >> 16, start & 0xffff, (i - 1) & 0xffff);
+    }
+}
+
+// One instruction, instantiated once per fixed set of CORE_* features
+// by the run loop's slice functions. Features left out of the set are
+// folded away by the compiler, so the production variants carry no
+// branch for tracing or profiling. cpu_step_emulator() is the variant
+// that checks everything at run time.
+#define CORE_CGB            0x01    // Double speed halves instruction clocks.
+#define CORE_TRACE          0x02    // Print opcodes while emulator->trace is set.
+#define CORE_PROFILE        0x04    // Feed an attached profiler.
+#define CORE_STOP_PC        0x08    // Slice ends before a given PC.
+#define CORE_DEBUGGER       0x10    // Slice ends on debugger breakpoints and step counts.
+#define CORE_ALL            (CORE_CGB | CORE_TRACE | CORE_PROFILE)
+
+static inline __attribute__((always_inline)) void cpu_step_core(struct gameboy_emulator_t *emulator, const uint32_t features)
+{
+    uint16_t pc = emulator->cpu.reg.pc.data;
+    uint16_t sp = emulator->cpu.reg.sp.data;
+    uint64_t cycles = emulator->cycles;
+
+    emulator->opcode = read_8_bit_immed_data_from_memory(emulator);
+    emulator->cycles += opcode_cycles[emulator->opcode] >> ((features & CORE_CGB) ? emulator->cgb.double_speed : 0);
+    if ((features & CORE_TRACE) && emulator->trace) printf("[DEBUG] Executing opcode = $%x\n", emulator->opcode);
+    switch (emulator->opcode) 
+    {
+        // http://gcc.gnu.org/onlinedocs/gcc/Statements-implementation.html#Statements-implementation
+        // Opcodes - https://gbdev.io/gb-opcodes/optables/
+        // 8-bit transer abd input/output instructions
+        case 0x7e:
+        case 0x46:
+        case 0x4e:
+        case 0x56:
+        case 0x5e:
+        case 0x66:
+        case 0x6e:
+            load_r_hl(emulator);
+            break;
+        case 0x06:
+        case 0x0e:
+        case 0x16:
+        case 0x1e:
+        case 0x26:
+        case 0x2e:
+        case 0x3e:
+            load_r_n(emulator);
+            break;
+        case 0x7f:              // LD A, r'
+        case 0x78 ... 0x7d:
+        case 0x40 ... 0x45:     // LD B, r'
+        case 0x47:
+        case 0x48:              // LD C, r'
+        case 0x49:
+        case 0x4f:
+        case 0x4a ... 0x4d:
+        case 0x50 ... 0x55:     // LD D, r'
+        case 0x57:
+        case 0x58:              // LD E, r'
+        case 0x59:
+        case 0x5a ... 0x5d:
+        case 0x60 ... 0x65:     // LD H, r'
+        case 0x67:
+        case 0x68:              // LD L, r'
+        case 0x69:
+        case 0x6a ... 0x6d:
+            load_r_r(emulator);
+            break;
+        case 0x70 ... 0x75:     // LD (HL), r'
+        case 0x77:
+            load_hl_r(emulator);
+            break;
+        case 0x36:
+            load_hl_n(emulator);
+            break;
+        case 0x0a:
+            load_r_immed_data(emulator, 0x07, emulator->cpu.reg.bc.data);
+            break;
+        case 0x1a:
+            load_r_immed_data(emulator, 0x07, emulator->cpu.reg.de.data);
+            break;
+        case 0xf2: 
+        {
+            uint16_t addr = 0xff00 + emulator->cpu.reg.bc.low;
+            load_r_immed_data(emulator, 0x07, addr);
+            break;
+        }
+        case 0xe2: 
+        {
+            uint16_t addr = 0xff00 + emulator->cpu.reg.bc.low;
+            load_immed_data_r(emulator, addr, 0x07);
+            break;
+        }
+        case 0xf0: 
+        {
+            uint16_t addr = 0xff00 + read_8_bit_immed_data_from_memory(emulator);
+            load_r_immed_data(emulator, 0x07, addr);
+            break;
+        }
+        case 0xe0: 
+        {
+            uint16_t addr = 0xff00 + read_8_bit_immed_data_from_memory(emulator);
+            load_immed_data_r(emulator, addr, 0x07);
+            break;
+        }
+        case 0xfa: 
+        {
+            uint16_t addr = read_16_bit_immed_data_from_memory(emulator);
+            load_r_immed_data(emulator, 0x07, addr);
+            break;
+        }
+        case 0xea: 
+        {
+            uint16_t addr = read_16_bit_immed_data_from_memory(emulator);
+            load_immed_data_r(emulator, addr, 0x07);
+            break;
+        }
+        case 0x2a: 
+        {
+            load_r_immed_data(emulator, 0x07, emulator->cpu.reg.hl.data);
+            emulator->cpu.reg.hl.data = emulator->cpu.reg.hl.data + 1;
+            break;
+        }
+        case 0x3a: 
+        {
+            load_r_immed_data(emulator, 0x07, emulator->cpu.reg.hl.data);
+            emulator->cpu.reg.hl.data = emulator->cpu.reg.hl.data - 1;
+            break;
+        }
+        case 0x02:
+            load_immed_data_r(emulator, emulator->cpu.reg.bc.data, 0x07);
+            break;
+        case 0x12:
+            load_immed_data_r(emulator, emulator->cpu.reg.de.data, 0x07);
+            break;
+        case 0x22: 
+        {
+            load_immed_data_r(emulator, emulator->cpu.reg.hl.data, 0x07);
+            emulator->cpu.reg.hl.data = emulator->cpu.reg.hl.data + 1;
+            break;
+        }
+        case 0x32: 
+        {
+            load_immed_data_r(emulator, emulator->cpu.reg.hl.data, 0x07);
+            emulator->cpu.reg.hl.data = emulator->cpu.reg.hl.data - 1;
+            break;
+        }
+        // 8-bit arithmetic and logic operation instructions
+        // TDOD. adc, sbc
+        case 0x87:
+        case 0x80 ... 0x85:
+            add_a_r(emulator);
+            break;
+        case 0x86:
+            add_a_hl(emulator);
+            break;
+        case 0x97:
+        case 0x90 ... 0x95:
+            sub_a_r(emulator);
+            break;
+        case 0xa7:
+        case 0xa0 ... 0xa5:
+            and_a_r(emulator);
+            break;
+        case 0xb7:
+        case 0xb0 ... 0xb5:
+            or_a_r(emulator);
+            break;
+        case 0xaf:
+        case 0xa8:
+        case 0xa9:
+        case 0xaa ... 0xad:
+            xor_a_r(emulator);
+            break;
+        case 0xfe:  // CP a, n
+            cp_a_n(emulator);
+            break;
+        case 0xbf:  // CP a, r
+        case 0xb8 ... 0xbd:
+            cp_a_r(emulator);
+            break;
+        case 0xbe:  // CP a, (hl)
+            cp_a_hl(emulator);
+            break;
+        case 0x04:
+        case 0x0c:
+        case 0x14:
+        case 0x1c:
+        case 0x3c:
+        case 0x24:
+        case 0x2c:
+            inc_r(emulator);
+            break;
+        case 0x3d:
+        case 0x05:
+        case 0x0d:
+        case 0x15:
+        case 0x1d:
+        case 0x25:
+        case 0x2d:
+            dec_r(emulator);
+            break;
+        // Roatate shift instructions
+        case 0x07:
+            rlca(emulator);
+            break;
+        case 0x17:
+            rla(emulator);
+            break;
+        case 0x0f: 
+            rrca(emulator);
+            break;
+        case 0x1f:
+            rra(emulator);
+            break;
+        // Extended instructions
+        case 0xcb:
+            // RLC r
+            // RL  r
+            // RRC r
+            // RR  r
+            // SLA r
+            // SRA r
+            // SRL r
+            // BIT b, r
+            // RES b, r
+            // SET b, r
+            bit_operations(emulator);
+            break;
+        // Jump instructions
+        case 0xc3:  // JP nn
+            jump_nn(emulator, read_16_bit_immed_data_from_memory(emulator));
+            break;
+        case 0xc2:
+        case 0xca:
+        case 0xd2:
+        case 0xda:  // JP cc, nn
+            jump_cc_nn(emulator, read_16_bit_immed_data_from_memory(emulator));
+            break;
+        case 0x20:
+        case 0x28:
+        case 0x30:
+        case 0x38:  // JR cc, n
+            jump_cc_n(emulator, read_8_bit_immed_data_from_memory(emulator));
+            break;
+        case 0x18:  // JR n
+            jump_n(emulator, read_8_bit_immed_data_from_memory(emulator));
+            break;
+        case 0xe9:  // JP (hl)
+            jump_nn(emulator, emulator->cpu.reg.hl.data);
+            break;
+        // Call instructions
+        case 0xcd:  // Call nn
+            call_nn(emulator, read_16_bit_immed_data_from_memory(emulator));
+            break;
+        case 0xc4:  // Call cc, nn
+        case 0xcc:
+        case 0xd4:
+        case 0xdc:
+            call_cc_nn(emulator, read_16_bit_immed_data_from_memory(emulator));
+            break;
+        case 0xc9:  // RET
+            ret(emulator);
+            break;
+        case 0xc0:
+        case 0xc8:
+        case 0xd0:
+        case 0xd8:
+            ret_cc(emulator);
+            break;
+        // 16 bit transfer instructions
+        case 0x01:  // LD rr, nn
+        case 0x11:
+        case 0x21:
+        case 0x31:
+            ld_rr_nn(emulator);
+            break;
+        case 0xc5:  // Push rr
+        case 0xd5:
+        case 0xe5:
+        case 0xf5:
+            push_qq(emulator);
+            break;
+        case 0xc1:  // Pop rr
+        case 0xd1:
+        case 0xe1:
+        case 0xf1:
+            pop_qq(emulator);
+            break;
+        case 0xf9:
+            emulator->cpu.reg.sp.data = emulator->cpu.reg.hl.data;
+            break;
+        case 0x08:
+            ld_nn_sp(emulator);
+            break;
+        // 16 bit atirthmetic
+        case 0x03:  // INC rr
+        case 0x13:
+        case 0x23:
+        case 0x33:
+            inc_rr(emulator);
+            break;
+        case 0x0b:  // DEC rr
+        case 0x1b:
+        case 0x2b:
+        case 0x3b:
+            dec_rr(emulator);
+            break;
+        case 0x10:  // STOP
+            read_8_bit_immed_data_from_memory(emulator);
+            cgb_stop(emulator);
+            break;
+        default:
+        {
+            if (!emulator->contain_faults)
+            {
+                printf("[DEBUG] Instruction $%x Not Implemented.\n", emulator->opcode);
+                dum_cpu_registers(emulator);
+                exit(0);
+            }
+            // Stop this machine on the opcode instead, e.g. so that one
+            // broken guest does not end a server's other sessions. The
+            // caller reports it.
+            emulator->faulted = 1;
+            emulator->cpu.reg.pc.data = pc;
+            emulator->cycles = cycles;
+            emulator->slice_end = 0;
+            return;
+        }
+    }
+
+    if ((features & CORE_PROFILE) && emulator->profiler) profiler_record(emulator, pc, sp, cycles);
+}
+
+void cpu_step_emulator(struct gameboy_emulator_t *emulator)
+{
+    cpu_step_core(emulator, CORE_ALL);
+}
+
+// Serial link
+//
+// A transfer on the internal clock shifts 8 bits at 8192 Hz, and
+// completes as one scheduler event 4096 clocks after the write to SC.
+// Only then does the instance sync with its link peer: there is no
+// per cycle lockstep, and both instances run freely in between.
+//
+// An in-process peer that is behind is first run up to the clock of
+// the exchange, so a peer driven after this instance receives at the
+// exact clock. A peer already ahead receives at its own current clock.
+// A socket peer answers from its next VBlank. Without a peer, or when
+// the peer is not waiting on an external clock transfer, 0xff is
+// shifted in, as with no cable plugged in.
+// For more details: https://gbdev.io/pandocs/Serial_Data_Transfer_(Link_Cable).html
+#define SERIAL_TRANSFER_CLOCKS  4096
+#define LINK_TRANSFER           0x01
+#define LINK_REPLY              0x02
+
+struct link_port_t {
+    // In-process peer, or a connected socket (-1 if none).
+    struct gameboy_emulator_t *peer;
+    struct link_port_t *peer_port;
+    int socket;
+    // Own clock when connected, so peers may differ in uptime.
+    uint64_t base;
+    uint64_t exchanges;
+};
+
+uint8_t emulator_run_cycles(struct gameboy_emulator_t *emulator, uint64_t cycles);
+
+static uint8_t serial_receive(struct gameboy_emulator_t *emulator, uint8_t data)
+{
+    // The peer clocked a byte in. Returns the byte shifted out.
+    uint8_t out = emulator->memory.blocks[0xff01];
+
+    if ((emulator->memory.blocks[0xff02] & 0x81) != 0x80) return 0xff;
+    emulator->memory.blocks[0xff01] = data;
+    emulator->memory.blocks[0xff02] &= 0x7f;
+    emulator->memory.blocks[0xff0f] |= 0x08;    // Serial interrupt request
+    return out;
+}
+
+static int link_send(int socket, uint8_t type, uint8_t data)
+{
+    uint8_t message[2] = { type, data };
+    return send(socket, message, sizeof(message), MSG_NOSIGNAL) == sizeof(message) ? 0 : -1;
+}
+
+static int link_receive(int socket, uint8_t *message, int flags)
+{
+    // Returns 1 for a message, 0 if none is waiting, -1 on hang up.
+    ssize_t size = recv(socket, message, 2, flags);
+
+    if (size == 2) return 1;
+    if (size < 0 && (flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (size == 1 && recv(socket, &message[1], 1, 0) == 1) return 1;
+    return -1;
+}
+
+static void link_hang_up(struct gameboy_emulator_t *emulator)
+{
+    printf("[WARN ] Link peer disconnected.\n");
+    close(emulator->link->socket);
+    emulator->link->socket = -1;
+}
+
+static uint8_t link_exchange(struct gameboy_emulator_t *emulator, uint8_t data)
+{
+    struct link_port_t *link = emulator->link;
+    uint8_t message[2];
+
+    link->exchanges++;
+    if (link->peer)
+    {
+        struct gameboy_emulator_t *peer = link->peer;
+        uint64_t target = emulator->cycles - link->base + link->peer_port->base;
+
+        if (peer->cycles < target) emulator_run_cycles(peer, target - peer->cycles);
+        return serial_receive(peer, data);
+    }
+    if (link->socket < 0) return 0xff;
+
+    if (link_send(link->socket, LINK_TRANSFER, data) != 0)
+    {
+        link_hang_up(emulator);
+        return 0xff;
+    }
+    for (;;)
+    {
+        // Both ends may start a transfer at once; answer the peer's
+        // while waiting for the reply to ours.
+        if (link_receive(link->socket, message, 0) != 1)
+        {
+            link_hang_up(emulator);
+            return 0xff;
+        }
+        if (message[0] == LINK_REPLY) return message[1];
+        link_send(link->socket, LINK_REPLY, serial_receive(emulator, message[1]));
+    }
+}
+
+static void link_poll(struct gameboy_emulator_t *emulator)
+{
+    // Answers transfers a socket peer clocked since the last poll.
+    struct link_port_t *link = emulator->link;
+    uint8_t message[2];
+    int result;
+
+    if (link->socket < 0) return;
+    while ((result = link_receive(link->socket, message, MSG_DONTWAIT)) == 1)
+        if (message[0] == LINK_TRANSFER) link_send(link->socket, LINK_REPLY, serial_receive(emulator, message[1]));
+    if (result < 0) link_hang_up(emulator);
+}
+
+static void serial_write(struct gameboy_emulator_t *emulator)
+{
+    // SC written. Only the internal clock side schedules the transfer;
+    // an external clock side waits for its peer.
+    uint8_t sc = emulator->memory.blocks[0xff02];
+
+    emulator->serial.transfer_end = 0;
+    if ((sc & 0x81) != 0x81) return;
+
+    // The internal clock runs twice as fast in double speed mode.
+    emulator->serial.transfer_end = emulator->cycles + (SERIAL_TRANSFER_CLOCKS >> emulator->cgb.double_speed);
+    if (emulator->serial.transfer_end < emulator->next_event) emulator->next_event = emulator->serial.transfer_end;
+    if (emulator->next_event < emulator->slice_end) emulator->slice_end = emulator->next_event;
+}
+
+static void serial_step_emulator(struct gameboy_emulator_t *emulator)
+{
+    uint8_t data = emulator->memory.blocks[0xff01];
+
+    if (!emulator->serial.transfer_end || emulator->cycles < emulator->serial.transfer_end) return;
+    emulator->serial.transfer_end = 0;
+    emulator->memory.blocks[0xff01] = emulator->link ? link_exchange(emulator, data) : 0xff;
+    emulator->memory.blocks[0xff02] &= 0x7f;
+    emulator->memory.blocks[0xff0f] |= 0x08;    // Serial interrupt request
+}
+
+void link_connect(struct gameboy_emulator_t *a, struct link_port_t *port_a,
+                  struct gameboy_emulator_t *b, struct link_port_t *port_b)
+{
+    // Links two instances in this process. Drive both from one thread.
+    memset(port_a, 0, sizeof(*port_a));
+    memset(port_b, 0, sizeof(*port_b));
+    port_a->peer = b;
+    port_a->peer_port = port_b;
+    port_a->socket = -1;
+    port_a->base = a->cycles;
+    port_b->peer = a;
+    port_b->peer_port = port_a;
+    port_b->socket = -1;
+    port_b->base = b->cycles;
+    a->link = port_a;
+    b->link = port_b;
+}
+
+int link_connect_socket(struct gameboy_emulator_t *emulator, struct link_port_t *port, const char *path, int listen_first)
+{
+    // Links to an instance in another process over a Unix domain
+    // socket. One side listens on path, the other connects to it.
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(port, 0, sizeof(*port));
+    port->socket = -1;
+    if (fd < 0 || strlen(path) >= sizeof(addr.sun_path)) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (listen_first)
+    {
+        int server = fd;
+        unlink(path);
+        if (bind(server, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(server, 1) != 0)
+        {
+            close(server);
+            return -1;
+        }
+        fd = accept(server, NULL, NULL);
+        close(server);
+        unlink(path);
+        if (fd < 0) return -1;
+    }
+    else if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    port->socket = fd;
+    port->base = emulator->cycles;
+    emulator->link = port;
+    return 0;
+}
+
+void link_disconnect(struct gameboy_emulator_t *emulator)
+{
+    struct link_port_t *link = emulator->link;
+
+    if (link == NULL) return;
+    if (link->peer) link->peer->link = NULL;
+    if (link->socket >= 0) close(link->socket);
+    link->socket = -1;
+    emulator->link = NULL;
+}
+
+// Joypad
+//
+// P1 ($FF00) is kept current in memory. It is recomputed when the
+// guest writes the select bits and when the buttons change, so reading
+// it needs no trap.
+#define JOYPAD_RIGHT        0x01
+#define JOYPAD_LEFT         0x02
+#define JOYPAD_UP           0x04
+#define JOYPAD_DOWN         0x08
+#define JOYPAD_A            0x10
+#define JOYPAD_B            0x20
+#define JOYPAD_SELECT       0x40
+#define JOYPAD_START        0x80
+
+static void joypad_update(struct gameboy_emulator_t *emulator)
+{
+    // Lines read 0 while a selected button is held; a line going low
+    // requests the joypad interrupt.
+    uint8_t p1 = emulator->memory.blocks[0xff00];
+    uint8_t lines = 0x0f;
+
+    if (!(p1 & 0x10)) lines &= ~emulator->joypad.buttons;
+    if (!(p1 & 0x20)) lines &= ~(emulator->joypad.buttons >> 4);
+    if (emulator->joypad.lines & ~lines) emulator->memory.blocks[0xff0f] |= 0x10;
+    emulator->joypad.lines = lines;
+    emulator->memory.blocks[0xff00] = 0xc0 | (p1 & 0x30) | lines;
+}
+
+static void joypad_press(struct gameboy_emulator_t *emulator, uint8_t buttons)
+{
+    emulator->joypad.buttons = buttons;
+    joypad_update(emulator);
+}
+
+// Game Boy Color
+//
+// CGB mode is chosen by the cartridge header. The bus stays a flat
+// array: switching a VRAM or WRAM bank copies the old bank out to its
+// backing store and the new one in, which costs a few hundred
+// nanoseconds per switch but leaves every other access untouched.
+// Double speed mode halves the clocks an instruction takes, so the
+// PPU, APU and every scheduler event keep running at 4.19 MHz.
+// HDMA copies whole blocks with memcpy(): all at once for general
+// purpose DMA, and 16 bytes per visible line in HBlank mode.
+// For more details: https://gbdev.io/pandocs/CGB_Registers.html
+#define CGB_SPEED_SWITCH_CLOCKS 8200
+#define CGB_HDMA_BLOCK_CLOCKS   32
+
+static void cgb_switch_vram(struct gameboy_emulator_t *emulator, uint8_t bank)
+{
+    struct cgb_t *cgb = &emulator->cgb;
+
+    if (bank != cgb->vram_bank)
+    {
+        memcpy(cgb->vram[cgb->vram_bank], &emulator->memory.blocks[0x8000], 0x2000);
+        memcpy(&emulator->memory.blocks[0x8000], cgb->vram[bank], 0x2000);
+        cgb->vram_bank = bank;
+    }
+    emulator->memory.blocks[0xff4f] = 0xfe | bank;
+}
+
+static void cgb_switch_wram(struct gameboy_emulator_t *emulator, uint8_t bank)
+{
+    struct cgb_t *cgb = &emulator->cgb;
+
+    if (bank == 0) bank = 1;
+    if (bank != cgb->wram_bank)
+    {
+        memcpy(cgb->wram[cgb->wram_bank], &emulator->memory.blocks[0xd000], 0x1000);
+        memcpy(&emulator->memory.blocks[0xd000], cgb->wram[bank], 0x1000);
+        cgb->wram_bank = bank;
+    }
+    emulator->memory.blocks[0xff70] = 0xf8 | bank;
+}
+
+static const uint8_t *cgb_vram(const struct gameboy_emulator_t *emulator, uint8_t bank)
+{
+    // A VRAM bank as the PPU sees it, whichever bank the CPU selected.
+    if (bank == emulator->cgb.vram_bank) return &emulator->memory.blocks[0x8000];
+    return emulator->cgb.vram[bank];
+}
+
+static void cgb_hdma_copy(struct gameboy_emulator_t *emulator, uint8_t blocks)
+{
+    // Copies blocks of 16 bytes into the selected VRAM bank, wrapping
+    // at its end, and leaves HDMA1-4 pointing past them.
+    struct cgb_t *cgb = &emulator->cgb;
+    uint32_t length = blocks * 16;
+
+    while (length)
+    {
+        uint32_t chunk = 0x2000 - cgb->hdma_destination;
+        if (chunk > length) chunk = length;
+        if (cgb->hdma_source + chunk > 0x10000) chunk = 0x10000 - cgb->hdma_source;
+        // Guests may point the source into VRAM itself, so the ranges
+        // can overlap.
+        memmove(&emulator->memory.blocks[0x8000 + cgb->hdma_destination], &emulator->memory.blocks[cgb->hdma_source], chunk);
+        cgb->hdma_source = (cgb->hdma_source + chunk) & 0xffff;
+        cgb->hdma_destination = (cgb->hdma_destination + chunk) & 0x1ff0;
+        length -= chunk;
+    }
+    emulator->memory.blocks[0xff51] = cgb->hdma_source >> 8;
+    emulator->memory.blocks[0xff52] = cgb->hdma_source & 0xf0;
+    emulator->memory.blocks[0xff53] = (cgb->hdma_destination >> 8) | 0x80;
+    emulator->memory.blocks[0xff54] = cgb->hdma_destination & 0xf0;
+}
+
+static void cgb_hblank(struct gameboy_emulator_t *emulator)
+{
+    // One HBlank DMA block, at the end of a visible line. The CPU is
+    // halted while it runs.
+    struct cgb_t *cgb = &emulator->cgb;
+
+    cgb_hdma_copy(emulator, 1);
+    emulator->cycles += CGB_HDMA_BLOCK_CLOCKS;
+    cgb->hdma_blocks--;
+    emulator->memory.blocks[0xff55] = cgb->hdma_blocks ? cgb->hdma_blocks - 1 : 0xff;
+}
+
+static void cgb_palette_write(uint8_t *palettes, uint8_t *blocks, uint16_t index_addr, uint16_t data_addr, uint8_t data_written)
+{
+    // BCPS/OCPS select a byte of palette RAM, with auto increment in
+    // bit 7. BCPD/OCPD always read back the selected byte.
+    uint8_t index = blocks[index_addr] & 0x3f;
+
+    if (data_written)
+    {
+        palettes[index] = blocks[data_addr];
+        if (blocks[index_addr] & 0x80) index = (index + 1) & 0x3f;
+    }
+    blocks[index_addr] = (blocks[index_addr] & 0x80) | 0x40 | index;
+    blocks[data_addr] = palettes[index];
+}
+
+static void cgb_write(struct gameboy_emulator_t *emulator, uint16_t addr)
+{
+    struct cgb_t *cgb = &emulator->cgb;
+    uint8_t *blocks = emulator->memory.blocks;
+    uint8_t data = blocks[addr];
+
+    switch (addr)
+    {
+        case 0xff4d:    // KEY1: only the switch request is writable
+            blocks[0xff4d] = (cgb->double_speed << 7) | 0x7e | (data & 0x01);
+            break;
+        case 0xff4f:    // VBK
+            cgb_switch_vram(emulator, data & 0x01);
+            break;
+        case 0xff51:
+        case 0xff52:
+            cgb->hdma_source = ((blocks[0xff51] << 8) | blocks[0xff52]) & 0xfff0;
+            break;
+        case 0xff53:
+        case 0xff54:
+            cgb->hdma_destination = ((blocks[0xff53] << 8) | blocks[0xff54]) & 0x1ff0;
+            break;
+        case 0xff55:    // HDMA5: start a transfer, or stop an HBlank one
+            if (cgb->hdma_blocks && !(data & 0x80))
+            {
+                cgb->hdma_blocks = 0;
+                blocks[0xff55] = 0x80 | (data & 0x7f);
+            }
+            else if (data & 0x80)
+            {
+                cgb->hdma_blocks = (data & 0x7f) + 1;
+                blocks[0xff55] = data & 0x7f;
+            }
+            else
+            {
+                cgb_hdma_copy(emulator, (data & 0x7f) + 1);
+                emulator->cycles += ((data & 0x7f) + 1) * CGB_HDMA_BLOCK_CLOCKS;
+                blocks[0xff55] = 0xff;
+            }
+            break;
+        case 0xff68:
+        case 0xff69:
+            cgb_palette_write(cgb->bg_palettes, blocks, 0xff68, 0xff69, addr == 0xff69);
+            break;
+        case 0xff6a:
+        case 0xff6b:
+            cgb_palette_write(cgb->obj_palettes, blocks, 0xff6a, 0xff6b, addr == 0xff6b);
+            break;
+        case 0xff70:    // SVBK
+            cgb_switch_wram(emulator, data & 0x07);
+            break;
+    }
+}
+
+static void cgb_stop(struct gameboy_emulator_t *emulator)
+{
+    // STOP performs a speed switch armed through KEY1. Low power mode
+    // is not emulated: with no interrupts there is nothing to wake up
+    // from, so otherwise it just falls through.
+    uint8_t *key1 = &emulator->memory.blocks[0xff4d];
+
+    if (!emulator->cgb.enabled || !(*key1 & 0x01)) return;
+    emulator->cgb.double_speed ^= 0x01;
+    *key1 = (emulator->cgb.double_speed << 7) | 0x7e;
+    emulator->cycles += CGB_SPEED_SWITCH_CLOCKS;
+}
+
+static void cgb_power_up(struct gameboy_emulator_t *emulator)
+{
+    // State the CGB boot ROM hands over to a CGB cartridge. A = $11
+    // is how the cartridge tells it is running on a CGB.
+    // For more details: https://gbdev.io/pandocs/Power_Up_Sequence.html
+    struct cgb_t *cgb = &emulator->cgb;
+    uint8_t *blocks = emulator->memory.blocks;
+
+    cgb->enabled = 1;
+    cgb->double_speed = 0;
+    cgb->vram_bank = 0;
+    cgb->wram_bank = 1;
+    cgb->hdma_blocks = 0;
+    memset(cgb->vram, 0, sizeof(cgb->vram));
+    memset(cgb->wram, 0, sizeof(cgb->wram));
+    // Background palettes start out white, object palettes are left
+    // as the RAM powered up.
+    memset(cgb->bg_palettes, 0xff, sizeof(cgb->bg_palettes));
+    memset(cgb->obj_palettes, 0, sizeof(cgb->obj_palettes));
+
+    emulator->cpu.reg.af.data = 0x1180;
+    emulator->cpu.reg.bc.data = 0x0000;
+    emulator->cpu.reg.de.data = 0xff56;
+    emulator->cpu.reg.hl.data = 0x000d;
+    emulator->cpu.flags.z_flag = 1;
+    emulator->cpu.flags.n_flag = 0;
+    emulator->cpu.flags.h_flag = 0;
+    emulator->cpu.flags.c_flag = 0;
+
+    blocks[0xff4d] = 0x7e;
+    blocks[0xff4f] = 0xfe;
+    blocks[0xff55] = 0xff;
+    blocks[0xff68] = 0xc0;
+    blocks[0xff69] = 0xff;
+    blocks[0xff6a] = 0xc0;
+    blocks[0xff6b] = 0x00;
+    blocks[0xff70] = 0xf9;
+}
+
+// Runtime metrics
+//
+// An instance can export its counters to a POSIX shared memory object
+// of its own, /gb-metrics-<pid>-<n>, which `--top` in any other
+// process maps read-only and samples without stopping anyone. The run
+// loop counts retired instructions in a register per slice; shared
+// memory is only written once per frame. Rates and ratios are left to
+// the reader, from the deltas between its samples.
+#define METRICS_MAGIC           0x534d4247      // "GBMS"
+#define METRICS_VERSION         1
+#define METRICS_PREFIX          "gb-metrics-"
+#define METRICS_MAX_INSTANCES   256
+#define METRICS_FRAME_RATE      ((double) CPU_CLOCK / (CLOCKS_PER_LINE * LINES_PER_FRAME))
+
+struct metrics_shared_t {
+    // Every counter is stored whole, so readers never see a torn
+    // value, though counters may be a frame apart from each other.
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    char title[16];
+    _Atomic uint64_t updated_ns;        // Host clock of the last update.
+    _Atomic uint64_t instructions;
+    _Atomic uint64_t frames;
+    _Atomic uint64_t busy_ns;           // Host time spent emulating.
+    _Atomic uint64_t frame_ns;          // Host time from the previous frame to the last.
+    _Atomic uint64_t audio_underruns;
+    _Atomic uint64_t audio_overruns;
+};
+
+struct metrics_t {
+    struct metrics_shared_t *shared;
+    char name[64];
+    // Kept by the emulation thread, published at every frame.
+    uint64_t instructions;
+    uint64_t frames;
+    uint64_t busy_ns;
+    uint64_t run_start_ns;
+    uint64_t frame_start_ns;
+};
+
+static uint64_t host_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+int metrics_open(struct metrics_t *metrics)
+{
+    static _Atomic uint32_t instances;
+    int fd;
+
+    memset(metrics, 0, sizeof(*metrics));
+    snprintf(metrics->name, sizeof(metrics->name), "/" METRICS_PREFIX "%d-%u", (int) getpid(), atomic_fetch_add(&instances, 1));
+    if ((fd = shm_open(metrics->name, O_CREAT | O_EXCL | O_RDWR, 0644)) < 0) return -1;
+    if (ftruncate(fd, sizeof(struct metrics_shared_t)) != 0 ||
+        (metrics->shared = mmap(NULL, sizeof(struct metrics_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        close(fd);
+        shm_unlink(metrics->name);
+        metrics->shared = NULL;
+        return -1;
+    }
+    close(fd);
+    metrics->shared->pid = getpid();
+    metrics->shared->version = METRICS_VERSION;
+    atomic_store_explicit(&metrics->shared->updated_ns, host_time_ns(), memory_order_relaxed);
+    // Readers skip the object until the magic is in.
+    atomic_thread_fence(memory_order_release);
+    metrics->shared->magic = METRICS_MAGIC;
+    return 0;
+}
+
+void metrics_attach(struct gameboy_emulator_t *emulator, struct metrics_t *metrics)
+{
+    // Attaches to the loaded cartridge, whose title the reader shows.
+    // Pass NULL to detach. A zeroed metrics_t that was never opened
+    // only counts, with nothing published.
+    int i;
+
+    emulator->metrics = metrics;
+    if (metrics == NULL) return;
+    metrics->frame_start_ns = 0;
+    if (metrics->shared == NULL) return;
+    for (i = 0; i < 15; i++)
+    {
+        char c = emulator->memory.rom[0x0134 + i];
+        metrics->shared->title[i] = (c >= 0x20 && c < 0x7f) ? c : '\0';
+        if (c == '\0') break;
+    }
+}
+
+void metrics_close(struct metrics_t *metrics)
+{
+    if (metrics->shared == NULL) return;
+    munmap(metrics->shared, sizeof(struct metrics_shared_t));
+    shm_unlink(metrics->name);
+    metrics->shared = NULL;
+}
+
+static void metrics_frame(struct gameboy_emulator_t *emulator)
+{
+    struct metrics_t *metrics = emulator->metrics;
+    struct metrics_shared_t *shared = metrics->shared;
+    struct audio_output_t *output = emulator->apu.output;
+    uint64_t now;
+
+    metrics->frames++;
+    if (shared == NULL) return;
+    now = host_time_ns();
+    atomic_store_explicit(&shared->instructions, metrics->instructions, memory_order_relaxed);
+    atomic_store_explicit(&shared->frames, metrics->frames, memory_order_relaxed);
+    atomic_store_explicit(&shared->busy_ns, metrics->busy_ns + now - metrics->run_start_ns, memory_order_relaxed);
+    if (metrics->frame_start_ns) atomic_store_explicit(&shared->frame_ns, now - metrics->frame_start_ns, memory_order_relaxed);
+    metrics->frame_start_ns = now;
+    if (output && output->ring)
+    {
+        atomic_store_explicit(&shared->audio_underruns, atomic_load(&output->ring->underruns), memory_order_relaxed);
+        atomic_store_explicit(&shared->audio_overruns, atomic_load(&output->ring->overruns), memory_order_relaxed);
+    }
+    atomic_store_explicit(&shared->updated_ns, now, memory_order_release);
+}
+
+#ifndef GB_LIBRARY
+struct metrics_sample_t {
+    char name[64];
+    struct metrics_shared_t data;
+    uint64_t taken_ns;
+};
+
+static int metrics_read(const char *name, struct metrics_shared_t *data)
+{
+    char path[NAME_MAX + 2];
+    struct metrics_shared_t *shared;
+    struct stat st;
+    int fd;
+
+    snprintf(path, sizeof(path), "/%s", name);
+    if ((fd = shm_open(path, O_RDONLY, 0)) < 0) return -1;
+    // Objects are sized after they are created, and a short one would
+    // fault on the first read past its end.
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(*shared))
+    {
+        close(fd);
+        return -1;
+    }
+    shared = mmap(NULL, sizeof(*shared), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) return -1;
+
+    data->magic = shared->magic;
+    atomic_thread_fence(memory_order_acquire);
+    data->version = shared->version;
+    data->pid = shared->pid;
+    memcpy(data->title, shared->title, sizeof(data->title));
+    data->title[sizeof(data->title) - 1] = '\0';
+    atomic_init(&data->updated_ns, atomic_load_explicit(&shared->updated_ns, memory_order_acquire));
+    atomic_init(&data->instructions, atomic_load_explicit(&shared->instructions, memory_order_relaxed));
+    atomic_init(&data->frames, atomic_load_explicit(&shared->frames, memory_order_relaxed));
+    atomic_init(&data->busy_ns, atomic_load_explicit(&shared->busy_ns, memory_order_relaxed));
+    atomic_init(&data->frame_ns, atomic_load_explicit(&shared->frame_ns, memory_order_relaxed));
+    atomic_init(&data->audio_underruns, atomic_load_explicit(&shared->audio_underruns, memory_order_relaxed));
+    atomic_init(&data->audio_overruns, atomic_load_explicit(&shared->audio_overruns, memory_order_relaxed));
+    munmap(shared, sizeof(*shared));
+    return data->magic == METRICS_MAGIC && data->version == METRICS_VERSION ? 0 : -1;
+}
+
+static int metrics_top_main(double interval, int count)
+{
+    // Prints all live instances every interval seconds, count times,
+    // or until interrupted if count is 0. Instances of processes that
+    // are gone are skipped; their objects stay until removed from
+    // /dev/shm.
+    static struct metrics_sample_t previous[METRICS_MAX_INSTANCES], current[METRICS_MAX_INSTANCES];
+    int previous_count = 0, iteration;
+    struct timespec pause;
+
+    if (interval <= 0) interval = 1.0;
+    pause.tv_sec = (time_t) interval;
+    pause.tv_nsec = (long) ((interval - pause.tv_sec) * 1e9);
+
+    for (iteration = 0; count == 0 || iteration < count; iteration++)
+    {
+        DIR *dir = opendir("/dev/shm");
+        struct dirent *entry;
+        int current_count = 0, i, j;
+
+        if (dir == NULL)
+        {
+            printf("[ERROR] Cannot list /dev/shm.\n");
+            return 1;
+        }
+        while ((entry = readdir(dir)) != NULL && current_count < METRICS_MAX_INSTANCES)
+        {
+            struct metrics_sample_t *sample = &current[current_count];
+
+            if (strncmp(entry->d_name, METRICS_PREFIX, strlen(METRICS_PREFIX)) != 0) continue;
+            if (metrics_read(entry->d_name, &sample->data) != 0) continue;
+            if (kill(sample->data.pid, 0) != 0 && errno == ESRCH) continue;
+            snprintf(sample->name, sizeof(sample->name), "%s", entry->d_name + strlen(METRICS_PREFIX));
+            sample->taken_ns = host_time_ns();
+            current_count++;
+        }
+        closedir(dir);
+
+        if (isatty(STDOUT_FILENO)) printf("\033[H\033[2J");
+        printf("%d instances\n", current_count);
+        printf("%-14s %-16s %8s %7s %6s %9s %9s %5s %9s %9s\n", "INSTANCE", "TITLE", "MIPS", "FPS", "SPEED",
+               "BUSY/FRM", "HOST/FRM", "IDLE", "UNDERRUN", "OVERRUN");
+        for (i = 0; i < current_count; i++)
+        {
+            struct metrics_sample_t *now = &current[i], *then = NULL;
+            double seconds, frames, busy;
+
+            for (j = 0; j < previous_count; j++)
+                if (strcmp(previous[j].name, now->name) == 0) then = &previous[j];
+            if (then == NULL)
+            {
+                printf("%-14s %-16s %8s\n", now->name, now->data.title, "...");
+                continue;
+            }
+            seconds = (now->taken_ns - then->taken_ns) / 1e9;
+            frames = (double) (now->data.frames - then->data.frames);
+            busy = (now->data.busy_ns - then->data.busy_ns) / 1e9;
+            printf("%-14s %-16s %8.2f %7.1f %5.0f%% %7.2fms %7.2fms %4.0f%% %9llu %9llu\n", now->name, now->data.title,
+                   (now->data.instructions - then->data.instructions) / seconds / 1e6,
+                   frames / seconds, frames / seconds / METRICS_FRAME_RATE * 100.0,
+                   frames ? busy * 1e3 / frames : 0.0, now->data.frame_ns / 1e6,
+                   busy < seconds ? (1.0 - busy / seconds) * 100.0 : 0.0,
+                   (unsigned long long) now->data.audio_underruns, (unsigned long long) now->data.audio_overruns);
+        }
+        fflush(stdout);
+        memcpy(previous, current, sizeof(current[0]) * current_count);
+        previous_count = current_count;
+        if (count == 0 || iteration + 1 < count) nanosleep(&pause, NULL);
+    }
+    return 0;
+}
+#endif // GB_LIBRARY
+
+// Frame hashing
+//
+// Regression runs are compared by hash rather than by frame. A hash
+// log holds one record per finished frame: a 64 bit hash of the frame,
+// and every interval frames also a hash of the CPU registers and WRAM
+// ($C000-$DFFF). A run checked against a golden log stops at the first
+// frame that diverges, with the registers dumped.
+//
+// Logs hash native words, so compare logs made on hosts of the same
+// endianness.
+#define HASH_LOG_MAGIC      "GBHL"
+#define HASH_LOG_VERSION    1
+#define HASH_PRIME_1        0x9e3779b185ebca87ull
+#define HASH_PRIME_2        0xc2b2ae3d27d4eb4full
+#define HASH_PRIME_3        0x165667b19e3779f9ull
+
+struct hash_log_header_t {
+    char magic[4];
+    uint32_t version;
+    uint32_t interval;
+};
+
+struct hash_record_t {
+    uint64_t frame;
+    // 0 on frames without a state sample.
+    uint64_t state;
+};
+
+struct hash_log_t {
+    // Records are appended to file and compared against golden, each
+    // only if open.
+    FILE *file;
+    FILE *golden;
+    uint32_t interval;
+    uint64_t frames;
+    // Frame index of the first divergence plus one, 0 while none.
+    uint64_t mismatch;
+    // Render target while no frame buffers are attached.
+    uint8_t framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+};
+
+static inline uint64_t hash_rotate(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t hash_bytes(const uint8_t *data, size_t size)
+{
+    // Four independent multiply-rotate lanes over 32 byte blocks, in
+    // the manner of xxHash64, so the lanes pipeline (or vectorize)
+    // instead of one long dependency chain per byte.
+    uint64_t lane[4] = { HASH_PRIME_1 + HASH_PRIME_2, HASH_PRIME_2, 0, -HASH_PRIME_1 };
+    uint64_t hash;
+    size_t i;
+    int n;
+
+    for (i = 0; i + 32 <= size; i += 32)
+    {
+        for (n = 0; n < 4; n++)
+        {
+            uint64_t word;
+            memcpy(&word, &data[i + n * 8], sizeof(word));
+            lane[n] = hash_rotate(lane[n] + word * HASH_PRIME_2, 31) * HASH_PRIME_1;
+        }
+    }
+    hash = hash_rotate(lane[0], 1) + hash_rotate(lane[1], 7) + hash_rotate(lane[2], 12) + hash_rotate(lane[3], 18);
+    hash += size;
+    for (; i < size; i++) hash = hash_rotate(hash ^ (data[i] * HASH_PRIME_3), 11) * HASH_PRIME_1;
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static uint64_t hash_state(struct gameboy_emulator_t *emulator)
+{
+    struct cpu_core_t *cpu = &emulator->cpu;
+    uint8_t state[0x2000 + 20];
+    uint8_t f = (cpu->flags.z_flag << 7) | (cpu->flags.n_flag << 6) | (cpu->flags.h_flag << 5) | (cpu->flags.c_flag << 4);
+
+    state[0] = cpu->reg.af.high;
+    state[1] = f;
+    state[2] = cpu->reg.bc.high;
+    state[3] = cpu->reg.bc.low;
+    state[4] = cpu->reg.de.high;
+    state[5] = cpu->reg.de.low;
+    state[6] = cpu->reg.hl.high;
+    state[7] = cpu->reg.hl.low;
+    memcpy(&state[8], &cpu->reg.sp.data, 2);
+    memcpy(&state[10], &cpu->reg.pc.data, 2);
+    memcpy(&state[12], &emulator->cycles, 8);
+    memcpy(&state[20], &emulator->memory.blocks[0xc000], 0x2000);
+    return hash_bytes(state, sizeof(state));
+}
+
+void hash_log_attach(struct gameboy_emulator_t *emulator, struct hash_log_t *log)
+{
+    // Call hash_log_open() first. Pass NULL to detach.
+    if (emulator->hash_log && emulator->ppu.framebuffer == emulator->hash_log->framebuffer)
+        emulator->ppu.framebuffer = NULL;
+    emulator->hash_log = log;
+    if (log && emulator->ppu.framebuffer == NULL)
+    {
+        memset(log->framebuffer, 0, sizeof(log->framebuffer));
+        emulator->ppu.framebuffer = log->framebuffer;
+    }
+}
+
+int hash_log_open(struct hash_log_t *log, const char *path, const char *golden, uint32_t interval)
+{
+    // Either path may be NULL. Checking against a golden log uses its
+    // state interval.
+    struct hash_log_header_t header;
+
+    memset(log, 0, sizeof(*log));
+    if (golden)
+    {
+        if ((log->golden = fopen(golden, "rb")) == NULL) return -1;
+        if (fread(&header, sizeof(header), 1, log->golden) != 1 || memcmp(header.magic, HASH_LOG_MAGIC, 4) != 0 ||
+            header.version != HASH_LOG_VERSION)
+        {
+            printf("[ERROR] %s is not a hash log.\n", golden);
+            fclose(log->golden);
+            return -1;
+        }
+        interval = header.interval;
+    }
+    log->interval = interval;
+    if (path)
+    {
+        memcpy(header.magic, HASH_LOG_MAGIC, 4);
+        header.version = HASH_LOG_VERSION;
+        header.interval = interval;
+        if ((log->file = fopen(path, "wb")) == NULL || fwrite(&header, sizeof(header), 1, log->file) != 1)
+        {
+            if (log->file) fclose(log->file);
+            if (log->golden) fclose(log->golden);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void hash_log_close(struct hash_log_t *log)
+{
+    if (log->file) fclose(log->file);
+    if (log->golden) fclose(log->golden);
+    log->file = NULL;
+    log->golden = NULL;
+}
+
+static void hash_log_frame(struct gameboy_emulator_t *emulator)
+{
+    struct hash_log_t *log = emulator->hash_log;
+    struct hash_record_t record = { 0, 0 };
+    struct hash_record_t expected;
+
+    record.frame = hash_bytes(emulator->ppu.framebuffer, SCREEN_WIDTH * SCREEN_HEIGHT);
+    if (log->interval && log->frames % log->interval == 0) record.state = hash_state(emulator);
+    if (log->file) fwrite(&record, sizeof(record), 1, log->file);
+
+    if (log->golden && !log->mismatch)
+    {
+        if (fread(&expected, sizeof(expected), 1, log->golden) != 1)
+        {
+            printf("[INFO ] Golden run ends at frame %llu.\n", (unsigned long long) log->frames);
+            fclose(log->golden);
+            log->golden = NULL;
+        }
+        else if (record.frame != expected.frame || record.state != expected.state)
+        {
+            printf("[ERROR] Frame %llu diverges from the golden run (%s hash).\n",
+                   (unsigned long long) log->frames, record.frame != expected.frame ? "frame" : "state");
+            dum_cpu_registers(emulator);
+            log->mismatch = log->frames + 1;
+            emulator->slice_end = 0;
+        }
+    }
+    log->frames++;
+}
+
+int hash_log_compare(const char *path_a, const char *path_b)
+{
+    // Reports the first frame where two hash logs differ. Returns 0 if
+    // they match, 1 if they diverge, -1 on error.
+    struct hash_log_header_t header_a, header_b;
+    struct hash_record_t a, b;
+    FILE *file_a = fopen(path_a, "rb");
+    FILE *file_b = fopen(path_b, "rb");
+    uint64_t frame = 0;
+    int result = -1;
+
+    if (file_a == NULL || file_b == NULL ||
+        fread(&header_a, sizeof(header_a), 1, file_a) != 1 || fread(&header_b, sizeof(header_b), 1, file_b) != 1 ||
+        memcmp(header_a.magic, HASH_LOG_MAGIC, 4) != 0 || memcmp(header_b.magic, HASH_LOG_MAGIC, 4) != 0)
+    {
+        printf("[ERROR] Cannot read hash logs %s and %s.\n", path_a, path_b);
+        goto done;
+    }
+    if (header_a.interval != header_b.interval)
+        printf("[WARN ] State intervals differ (%u and %u), only frames compare.\n", header_a.interval, header_b.interval);
+
+    for (;; frame++)
+    {
+        int more_a = fread(&a, sizeof(a), 1, file_a) == 1;
+        int more_b = fread(&b, sizeof(b), 1, file_b) == 1;
+
+        if (!more_a || !more_b)
+        {
+            if (more_a || more_b)
+                printf("[INFO ] Runs match for %llu frames, then %s ends.\n", (unsigned long long) frame, more_a ? path_b : path_a);
+            else
+                printf("[INFO ] Runs match for all %llu frames.\n", (unsigned long long) frame);
+            result = 0;
+            break;
+        }
+        if (a.frame != b.frame)
+        {
+            printf("[ERROR] First divergence at frame %llu (frame hash).\n", (unsigned long long) frame);
+            result = 1;
+            break;
+        }
+        if (header_a.interval == header_b.interval && a.state != b.state)
+        {
+            printf("[ERROR] First divergence at frame %llu (state hash).\n", (unsigned long long) frame);
+            result = 1;
+            break;
+        }
+    }
+
+done:
+    if (file_a) fclose(file_a);
+    if (file_b) fclose(file_b);
+    return result;
+}
+
+// Frame buffers
+//
+// Triple buffer between the emulation thread and one consumer
+// (presenter, encoder). The PPU renders into the back buffer and
+// publishes it at VBlank by swapping it with the middle one; the
+// consumer swaps the middle buffer with its front buffer whenever a
+// fresh frame is there. Neither side ever waits or copies: a slow
+// consumer just misses frames.
+#define FRAME_INDEX_MASK    0x03
+#define FRAME_FRESH         0x04
+
+struct frame_buffers_t {
+    uint8_t frames[3][SCREEN_WIDTH * SCREEN_HEIGHT];
+    // CGB frames hold palette RAM indices instead of shades, and come
+    // with the 64 RGB555 colors palette RAM held when they ended.
+    uint16_t colors[3][64];
+    uint8_t color[3];
+    // Index of the middle buffer, FRAME_FRESH while nobody took it.
+    _Atomic uint32_t middle;
+    // Owned by the emulation thread.
+    uint32_t back;
+    uint64_t published;
+    // Owned by the consumer.
+    uint32_t front;
+};
+
+void frame_buffers_attach(struct gameboy_emulator_t *emulator, struct frame_buffers_t *buffers)
+{
+    // Starts rendering into buffers. Pass NULL to stop publishing.
+    emulator->ppu.frames_out = buffers;
+    emulator->ppu.framebuffer = emulator->hash_log ? emulator->hash_log->framebuffer : NULL;
+    if (buffers == NULL) return;
+
+    memset(buffers->frames, 0, sizeof(buffers->frames));
+    memset(buffers->color, 0, sizeof(buffers->color));
+    buffers->back = 0;
+    atomic_init(&buffers->middle, 1);
+    buffers->front = 2;
+    buffers->published = 0;
+    emulator->ppu.framebuffer = buffers->frames[buffers->back];
+}
+
+static void frame_buffers_publish(struct gameboy_emulator_t *emulator)
+{
+    struct frame_buffers_t *buffers = emulator->ppu.frames_out;
+    uint32_t old;
+    int i;
+
+    buffers->color[buffers->back] = emulator->cgb.enabled;
+    if (emulator->cgb.enabled)
+    {
+        for (i = 0; i < 32; i++)
+        {
+            buffers->colors[buffers->back][i] = emulator->cgb.bg_palettes[i * 2] | (emulator->cgb.bg_palettes[i * 2 + 1] << 8);
+            buffers->colors[buffers->back][32 + i] = emulator->cgb.obj_palettes[i * 2] | (emulator->cgb.obj_palettes[i * 2 + 1] << 8);
+        }
+    }
+    old = atomic_exchange_explicit(&buffers->middle, buffers->back | FRAME_FRESH, memory_order_acq_rel);
+
+    buffers->back = old & FRAME_INDEX_MASK;
+    buffers->published++;
+    emulator->ppu.framebuffer = buffers->frames[buffers->back];
+}
+
+const uint8_t *frame_buffers_acquire(struct frame_buffers_t *buffers)
+{
+    // Consumer side. Returns the newest frame not seen before, or
+    // NULL. The frame stays valid until the next successful call.
+    uint32_t old;
+
+    if (!(atomic_load_explicit(&buffers->middle, memory_order_acquire) & FRAME_FRESH)) return NULL;
+    old = atomic_exchange_explicit(&buffers->middle, buffers->front, memory_order_acq_rel);
+    buffers->front = old & FRAME_INDEX_MASK;
+    return buffers->frames[buffers->front];
+}
+
+void frame_color_rgb(uint16_t color, uint8_t *rgb)
+{
+    // RGB555, red in the low bits, to 8 bits per channel.
+    int i;
+    for (i = 0; i < 3; i++)
+    {
+        uint8_t c = (color >> (i * 5)) & 0x1f;
+        rgb[i] = (c << 3) | (c >> 2);
+    }
+}
+
+const uint16_t *frame_buffers_colors(const struct frame_buffers_t *buffers)
+{
+    // Consumer side. The colors of the frame last acquired, NULL if it
+    // is a DMG frame of shades.
+    return buffers->color[buffers->front] ? buffers->colors[buffers->front] : NULL;
+}
+
+// PPU rendering
+//
+// Whole scanlines are drawn when the PPU leaves them, from the
+// registers as they are at that point. Mid-line register writes are
+// not seen, which few games rely on.
+static inline uint8_t ppu_tile_pixel(const uint8_t *blocks, uint16_t tile, uint8_t row, uint8_t column)
+{
+    uint8_t low = blocks[tile + row * 2];
+    uint8_t high = blocks[tile + row * 2 + 1];
+    uint8_t bit = 7 - column;
+
+    return (((high >> bit) & 0x01) << 1) | ((low >> bit) & 0x01);
+}
+
+static inline uint16_t ppu_bg_tile(const uint8_t *blocks, uint8_t lcdc, uint16_t map, uint8_t x, uint8_t y)
+{
+    uint8_t index = blocks[map + (y / 8) * 32 + x / 8];
+
+    if (lcdc & 0x10) return 0x8000 + index * 16;      // Unsigned from $8000
+    return 0x9000 + (int8_t) index * 16;               // Signed from $9000
+}
+
+static void ppu_render_line(struct gameboy_emulator_t *emulator, uint8_t ly)
+{
+    const uint8_t *blocks = emulator->memory.blocks;
+    uint8_t *line = &emulator->ppu.framebuffer[ly * SCREEN_WIDTH];
+    uint8_t colors[SCREEN_WIDTH];
+    uint8_t lcdc = blocks[0xff40];
+    uint8_t bgp = blocks[0xff47];
+    uint8_t height = (lcdc & 0x04) ? 16 : 8;
+    uint8_t sprites[10];
+    int count = 0, i, x;
+
+    if (ly == 0) emulator->ppu.window_line = 0;
+    if (!(lcdc & 0x80))
+    {
+        memset(line, 0, SCREEN_WIDTH);
+        return;
+    }
+
+    // Background and window. With bit 0 of LCDC clear both are blank.
+    memset(colors, 0, sizeof(colors));
+    if (lcdc & 0x01)
+    {
+        uint8_t y = ly + blocks[0xff42];
+        uint8_t scx = blocks[0xff43];
+        uint8_t wx, wy;
+        uint16_t map = (lcdc & 0x08) ? 0x9c00 : 0x9800;
+        int window_x = SCREEN_WIDTH;
+
+        if ((lcdc & 0x20) && ly >= blocks[0xff4a] && blocks[0xff4b] < SCREEN_WIDTH + 7)
+            window_x = blocks[0xff4b] < 7 ? 0 : blocks[0xff4b] - 7;
+
+        for (x = 0; x < window_x; x++)
+        {
+            uint8_t bx = x + scx;
+            colors[x] = ppu_tile_pixel(blocks, ppu_bg_tile(blocks, lcdc, map, bx, y), y % 8, bx % 8);
+        }
+        if (window_x < SCREEN_WIDTH)
+        {
+            wy = emulator->ppu.window_line++;
+            map = (lcdc & 0x40) ? 0x9c00 : 0x9800;
+            for (x = window_x; x < SCREEN_WIDTH; x++)
+            {
+                wx = x + 7 - blocks[0xff4b];
+                colors[x] = ppu_tile_pixel(blocks, ppu_bg_tile(blocks, lcdc, map, wx, wy), wy % 8, wx % 8);
+            }
+        }
+    }
+    for (x = 0; x < SCREEN_WIDTH; x++) line[x] = (bgp >> (colors[x] * 2)) & 0x03;
+
+    if (!(lcdc & 0x02)) return;
+
+    // Sprites: the first 10 in OAM on this line. Lower X wins, then
+    // lower OAM index, so they are drawn from lowest priority up.
+    for (i = 0; i < 40 && count < 10; i++)
+    {
+        int top = blocks[0xfe00 + i * 4] - 16;
+        if (ly >= top && ly < top + height) sprites[count++] = i;
+    }
+    while (count--)
+    {
+        const uint8_t *oam;
+        uint8_t attributes, palette, row, tile;
+        int pick = count;
+
+        // Take out the lowest priority sprite left: highest X, then
+        // highest OAM index, compared explicitly since removal below
+        // does not keep the list in OAM order.
+        for (i = count - 1; i >= 0; i--)
+        {
+            uint8_t x_i = blocks[0xfe01 + sprites[i] * 4], x_pick = blocks[0xfe01 + sprites[pick] * 4];
+            if (x_i > x_pick || (x_i == x_pick && sprites[i] > sprites[pick])) pick = i;
+        }
+        oam = &blocks[0xfe00 + sprites[pick] * 4];
+        sprites[pick] = sprites[count];
+
+        attributes = oam[3];
+        palette = blocks[(attributes & 0x10) ? 0xff49 : 0xff48];
+        row = ly - (oam[0] - 16);
+        tile = oam[2];
+
+        if (attributes & 0x40) row = height - 1 - row;
+        if (height == 16) tile &= 0xfe;
+        for (i = 0; i < 8; i++)
+        {
+            uint8_t color;
+            x = oam[1] - 8 + i;
+            if (x < 0 || x >= SCREEN_WIDTH) continue;
+            color = ppu_tile_pixel(blocks, 0x8000 + tile * 16, row, (attributes & 0x20) ? 7 - i : i);
+            if (color == 0 || ((attributes & 0x80) && colors[x] != 0)) continue;
+            line[x] = (palette >> (color * 2)) & 0x03;
+        }
+    }
+}
+
+static void ppu_render_line_cgb(struct gameboy_emulator_t *emulator, uint8_t ly)
+{
+    // Pixels are palette RAM indices: BG palette * 4 + color, objects
+    // 32 + OBJ palette * 4 + color. Each BG map entry has attributes at
+    // the same offset in VRAM bank 1. LCDC bit 0 does not blank the
+    // background here, it only takes BG priority away.
+    const uint8_t *blocks = emulator->memory.blocks;
+    const uint8_t *vram[2] = { cgb_vram(emulator, 0), cgb_vram(emulator, 1) };
+    uint8_t *line = &emulator->ppu.framebuffer[ly * SCREEN_WIDTH];
+    uint8_t colors[SCREEN_WIDTH];
+    uint8_t priority[SCREEN_WIDTH];
+    uint8_t lcdc = blocks[0xff40];
+    uint8_t height = (lcdc & 0x04) ? 16 : 8;
+    uint8_t y = ly + blocks[0xff42];
+    uint8_t scx = blocks[0xff43];
+    uint8_t sprites[10];
+    uint8_t wy = 0;
+    int window_x = SCREEN_WIDTH;
+    int count = 0, i, x;
+
+    if (ly == 0) emulator->ppu.window_line = 0;
+    if (!(lcdc & 0x80))
+    {
+        memset(line, 0, SCREEN_WIDTH);
+        return;
+    }
+
+    if ((lcdc & 0x20) && ly >= blocks[0xff4a] && blocks[0xff4b] < SCREEN_WIDTH + 7)
+    {
+        window_x = blocks[0xff4b] < 7 ? 0 : blocks[0xff4b] - 7;
+        wy = emulator->ppu.window_line++;
+    }
+    for (x = 0; x < SCREEN_WIDTH; x++)
+    {
+        uint8_t window = x >= window_x;
+        uint8_t bx = window ? x + 7 - blocks[0xff4b] : x + scx;
+        uint8_t by = window ? wy : y;
+        uint16_t map = (lcdc & (window ? 0x40 : 0x08)) ? 0x1c00 : 0x1800;
+        uint16_t entry = map + (by / 8) * 32 + bx / 8;
+        uint8_t attributes = vram[1][entry];
+        uint8_t row = (attributes & 0x40) ? 7 - by % 8 : by % 8;
+        uint8_t column = (attributes & 0x20) ? 7 - bx % 8 : bx % 8;
+        uint16_t tile = (lcdc & 0x10) ? vram[0][entry] * 16 : 0x1000 + (int8_t) vram[0][entry] * 16;
+
+        colors[x] = ppu_tile_pixel(vram[(attributes >> 3) & 0x01], tile, row, column);
+        priority[x] = attributes & 0x80;
+        line[x] = (attributes & 0x07) * 4 + colors[x];
+    }
+
+    if (!(lcdc & 0x02)) return;
+
+    // The first 10 objects in OAM on this line. Lower OAM index wins
+    // regardless of X, so they are drawn from the last one back.
+    for (i = 0; i < 40 && count < 10; i++)
+    {
+        int top = blocks[0xfe00 + i * 4] - 16;
+        if (ly >= top && ly < top + height) sprites[count++] = i;
+    }
+    while (count--)
+    {
+        const uint8_t *oam = &blocks[0xfe00 + sprites[count] * 4];
+        uint8_t attributes = oam[3];
+        uint8_t row = ly - (oam[0] - 16);
+        uint8_t tile = oam[2];
+
+        if (attributes & 0x40) row = height - 1 - row;
+        if (height == 16) tile &= 0xfe;
+        for (i = 0; i < 8; i++)
+        {
+            uint8_t color;
+            x = oam[1] - 8 + i;
+            if (x < 0 || x >= SCREEN_WIDTH) continue;
+            color = ppu_tile_pixel(vram[(attributes >> 3) & 0x01], tile * 16, row, (attributes & 0x20) ? 7 - i : i);
+            if (color == 0) continue;
+            if ((lcdc & 0x01) && colors[x] != 0 && ((attributes & 0x80) || priority[x])) continue;
+            line[x] = 32 + (attributes & 0x07) * 4 + color;
+        }
+    }
+}
+
+void ppu_step_emulator(struct gameboy_emulator_t *emulator)
+{
+    while (emulator->cycles >= emulator->ppu.line_start + CLOCKS_PER_LINE)
+    {
+        uint8_t ly = (emulator->memory.blocks[0xff44] + 1) % LINES_PER_FRAME;
+
+        if (ly != 0 && ly <= VBLANK_LINE)
+        {
+            if (emulator->ppu.framebuffer)
+                (emulator->cgb.enabled ? ppu_render_line_cgb : ppu_render_line)(emulator, ly - 1);
+            if (emulator->cgb.hdma_blocks) cgb_hblank(emulator);
+        }
+        emulator->ppu.line_start += CLOCKS_PER_LINE;
+        emulator->memory.blocks[0xff44] = ly;
+        if (ly == VBLANK_LINE)
+        {
+            emulator->ppu.frames++;
+            emulator->memory.blocks[0xff0f] |= 0x01;    // VBlank interrupt request
+            apu_end_frame(emulator);
+            if (emulator->hash_log) hash_log_frame(emulator);
+            if (emulator->metrics) metrics_frame(emulator);
+            if (emulator->link) link_poll(emulator);
+            if (emulator->ppu.frames_out) frame_buffers_publish(emulator);
+        }
+    }
+}
+
+void emulator_step_events(struct gameboy_emulator_t *emulator)
+{
+    // Devices only have work at scanline boundaries, frame sequencer
+    // ticks, serial transfer ends and movie inputs, so between them
+    // this is a single compare.
+    uint64_t ppu_event;
+
+    if (emulator->cycles < emulator->next_event) return;
+
+    apu_step_emulator(emulator);
+    ppu_step_emulator(emulator);
+    serial_step_emulator(emulator);
+
+    ppu_event = emulator->ppu.line_start + CLOCKS_PER_LINE;
+    emulator->next_event = ppu_event < emulator->apu.next_tick ? ppu_event : emulator->apu.next_tick;
+    if (emulator->serial.transfer_end && emulator->serial.transfer_end < emulator->next_event)
+        emulator->next_event = emulator->serial.transfer_end;
+    if (emulator->movie)
+    {
+        uint64_t movie_event = movie_step(emulator);
+        if (movie_event < emulator->next_event) emulator->next_event = movie_event;
+    }
+}
+
+// Bounded runs
+//
+// emulator_run_until() executes whole slices of instructions between
+// scheduler events and evaluates stop conditions only at the slice
+// ends, so they add nothing to the per instruction path. A memory
+// condition traps writes to the page holding its byte, and the trap
+// ends the slice after the writing instruction. Only a PC condition
+// compares once per instruction, in a loop of its own.
+#define RUN_UNTIL_CYCLES            0x01
+#define RUN_UNTIL_VBLANK            0x02
+#define RUN_UNTIL_PC                0x04
+#define RUN_UNTIL_MEMORY_EQUALS     0x08
+#define RUN_UNTIL_MEMORY_CHANGES    0x10
+#define RUN_UNTIL_DEBUGGER          0x20    // Met only, on any stop of an attached debugger.
+
+struct run_condition_t {
+    // Any combination of RUN_UNTIL_* flags; the first met stops the run.
+    uint8_t flags;
+    uint64_t cycles;        // Budget in clocks, from the start of the run.
+    uint16_t pc;
+    uint16_t addr;
+    uint8_t value;          // RUN_UNTIL_MEMORY_EQUALS only.
+};
+
+static void boot_rom_unmap(struct gameboy_emulator_t *emulator)
+{
+    memcpy(emulator->memory.rom, emulator->memory.cartridge_head, 0x0100);
+    emulator->memory.boot_rom_mapped = 0;
+    memory_update_page_traps(emulator);
+}
+
+static void memory_trap(struct gameboy_emulator_t *emulator, uint16_t addr, uint8_t access)
+{
+    if (emulator->debugger) debugger_trap(emulator, addr, access);
+    if (emulator->run_watch && (access & TRAP_WRITE) && addr == emulator->run_watch_addr)
+        emulator->slice_end = 0;
+    if (!(access & TRAP_WRITE) || addr < 0xff00) return;
+    if (addr == 0xff00) joypad_update(emulator);
+    if (addr == 0xff02) serial_write(emulator);
+    if (emulator->memory.boot_rom_mapped && addr == 0xff50) boot_rom_unmap(emulator);
+    if (addr >= 0xff10 && addr <= 0xff3f) apu_write(emulator, addr);
+    if (emulator->cgb.enabled && addr >= 0xff4d) cgb_write(emulator, addr);
+}
+
+static void memory_update_page_traps(struct gameboy_emulator_t *emulator)
+{
+    memset(emulator->memory.page_traps, 0, sizeof(emulator->memory.page_traps));
+    if (emulator->debugger) debugger_set_page_traps(emulator);
+    if (emulator->run_watch) emulator->memory.page_traps[emulator->run_watch_addr >> 0x08] |= TRAP_WRITE;
+    // I/O registers with side effects, and the boot ROM's $FF50.
+    emulator->memory.page_traps[0xff] |= TRAP_IO;
+}
+
+static uint8_t run_until_memory_met(struct gameboy_emulator_t *emulator, const struct run_condition_t *condition, uint8_t initial)
+{
+    uint8_t value = emulator->memory.blocks[condition->addr];
+
+    if ((condition->flags & RUN_UNTIL_MEMORY_EQUALS) && value == condition->value) return RUN_UNTIL_MEMORY_EQUALS;
+    if ((condition->flags & RUN_UNTIL_MEMORY_CHANGES) && value != initial) return RUN_UNTIL_MEMORY_CHANGES;
+    return 0;
+}
+
+// Slices run up to slice_end with the features of one core variant.
+// The variant is chosen once per run: a DMG or CGB machine with no
+// trace or profiler gets a loop with nothing but dispatch in it.
+// Watchpoints need no variant, since they are page traps the bus
+// checks anyway for its I/O registers; breakpoints and step counts
+// are checked by the debugger variant only.
+#define CORE_SLICE(name, features) \
+    static uint32_t name(struct gameboy_emulator_t *emulator, uint16_t stop_pc) \
+    { \
+        uint32_t retired = 0; \
+        while (emulator->cycles < emulator->slice_end) \
+        { \
+            if (((features) & CORE_STOP_PC) && emulator->cpu.reg.pc.data == stop_pc) break; \
+            if (((features) & CORE_DEBUGGER) && debugger_stop(emulator)) break; \
+            cpu_step_core(emulator, (features)); \
+            retired++; \
+        } \
+        return retired; \
+    }
+
+CORE_SLICE(core_slice_dmg,      0)
+CORE_SLICE(core_slice_cgb,      CORE_CGB)
+CORE_SLICE(core_slice_debug,    CORE_ALL)
+CORE_SLICE(core_slice_debugger, CORE_ALL | CORE_DEBUGGER)
+CORE_SLICE(core_slice_dmg_pc,   CORE_STOP_PC)
+CORE_SLICE(core_slice_cgb_pc,   CORE_CGB | CORE_STOP_PC)
+CORE_SLICE(core_slice_debug_pc, CORE_ALL | CORE_STOP_PC)
+CORE_SLICE(core_slice_debugger_pc, CORE_ALL | CORE_DEBUGGER | CORE_STOP_PC)
+
+#define CORE_VARIANTS       4
+#define CORE_SLICES         (CORE_VARIANTS * 2)
+
+static uint32_t (*const core_slices[CORE_SLICES])(struct gameboy_emulator_t*, uint16_t) =
+{
+    core_slice_dmg, core_slice_cgb, core_slice_debug, core_slice_debugger,
+    core_slice_dmg_pc, core_slice_cgb_pc, core_slice_debug_pc, core_slice_debugger_pc,
+};
+
+static int core_select(const struct gameboy_emulator_t *emulator, uint8_t flags)
+{
+    // Index into core_slices[] for the machine as it is now configured.
+    int variant = emulator->debugger ? 3 : (emulator->trace || emulator->profiler) ? 2 : emulator->cgb.enabled ? 1 : 0;
+    return (flags & RUN_UNTIL_PC) ? variant + CORE_VARIANTS : variant;
+}
+
+uint8_t emulator_run_until(struct gameboy_emulator_t *emulator, const struct run_condition_t *condition)
+{
+    // Returns the RUN_UNTIL_* flag of the condition that was met, or 0
+    // if the machine faulted.
+    uint64_t deadline = (condition->flags & RUN_UNTIL_CYCLES) ? emulator->cycles + condition->cycles : UINT64_MAX;
+    uint64_t frames = emulator->ppu.frames;
+    uint8_t initial = emulator->memory.blocks[condition->addr];
+    uint32_t (*slice)(struct gameboy_emulator_t*, uint16_t) = core_slices[core_select(emulator, condition->flags)];
+    uint8_t met = 0;
+
+    if (condition->flags & (RUN_UNTIL_MEMORY_EQUALS | RUN_UNTIL_MEMORY_CHANGES))
+    {
+        if ((met = run_until_memory_met(emulator, condition, initial))) return met;
+        emulator->run_watch = 1;
+        emulator->run_watch_addr = condition->addr;
+        memory_update_page_traps(emulator);
+    }
+
+    if (emulator->debugger) debugger_resume(emulator);
+
+    if (emulator->metrics) emulator->metrics->run_start_ns = host_time_ns();
+    while (!met && !emulator->faulted)
+    {
+        uint32_t retired;
+
+        emulator->slice_end = emulator->next_event < deadline ? emulator->next_event : deadline;
+        retired = slice(emulator, condition->pc);
+        if ((condition->flags & RUN_UNTIL_PC) && emulator->cpu.reg.pc.data == condition->pc) met = RUN_UNTIL_PC;
+
+        if (emulator->metrics) emulator->metrics->instructions += retired;
+        emulator_step_events(emulator);
+
+        if (!met && emulator->debugger && debugger_stopped(emulator)) met = RUN_UNTIL_DEBUGGER;
+        if (!met && emulator->run_watch) met = run_until_memory_met(emulator, condition, initial);
+        if (!met && (condition->flags & RUN_UNTIL_VBLANK) && emulator->ppu.frames != frames) met = RUN_UNTIL_VBLANK;
+        if (!met && emulator->cycles >= deadline) met = RUN_UNTIL_CYCLES;
+    }
+
+    if (emulator->run_watch)
+    {
+        emulator->run_watch = 0;
+        memory_update_page_traps(emulator);
+    }
+    if (emulator->metrics) emulator->metrics->busy_ns += host_time_ns() - emulator->metrics->run_start_ns;
+    return met;
+}
+
+uint8_t emulator_run_cycles(struct gameboy_emulator_t *emulator, uint64_t cycles)
+{
+    struct run_condition_t condition = { RUN_UNTIL_CYCLES, cycles };
+    return emulator_run_until(emulator, &condition);
+}
+
+uint8_t emulator_run_until_vblank(struct gameboy_emulator_t *emulator)
+{
+    struct run_condition_t condition = { RUN_UNTIL_VBLANK };
+    return emulator_run_until(emulator, &condition);
+}
+
+uint8_t emulator_run_until_pc(struct gameboy_emulator_t *emulator, uint16_t pc, uint64_t max_cycles)
+{
+    struct run_condition_t condition = { RUN_UNTIL_PC | RUN_UNTIL_CYCLES, max_cycles, pc };
+    return emulator_run_until(emulator, &condition);
+}
+
+uint8_t emulator_run_until_equals(struct gameboy_emulator_t *emulator, uint16_t addr, uint8_t value, uint64_t max_cycles)
+{
+    struct run_condition_t condition = { RUN_UNTIL_MEMORY_EQUALS | RUN_UNTIL_CYCLES, max_cycles, 0, addr, value };
+    return emulator_run_until(emulator, &condition);
+}
+
+uint8_t emulator_run_until_changes(struct gameboy_emulator_t *emulator, uint16_t addr, uint64_t max_cycles)
+{
+    struct run_condition_t condition = { RUN_UNTIL_MEMORY_CHANGES | RUN_UNTIL_CYCLES, max_cycles, 0, addr };
+    return emulator_run_until(emulator, &condition);
+}
+
+// Debugger
+//
+// PC breakpoints live in a bitmap over the address space. While a
+// debugger is attached, emulator_run_until() runs the debugger variant
+// of the core, which checks the bitmap and the step budget before each
+// instruction. Watchpoints flag the bus pages they cover in
+// page_traps, so only accesses to those pages leave the fast path; a
+// matching access ends the slice once the instruction that made it
+// has completed. Either way the run returns RUN_UNTIL_DEBUGGER.
+#define DEBUGGER_WATCHPOINTS    16
+
+#define DEBUGGER_STEPPED        1
+#define DEBUGGER_BREAKPOINT     2
+#define DEBUGGER_WATCHPOINT     3
+
+struct watchpoint_t {
+    uint16_t start;
+    uint16_t end;           // Inclusive.
+    uint8_t access;         // TRAP_READ and/or TRAP_WRITE, 0 if unused.
+};
+
+struct debugger_t {
+    uint8_t breakpoints[0x10000 / 8];
+    struct watchpoint_t watchpoints[DEBUGGER_WATCHPOINTS];
+    // DEBUGGER_* reason the run stopped for, 0 while running. Cleared
+    // at the start of every emulator_run_until().
+    uint8_t stop;
+    uint16_t watch_addr;
+    uint8_t watch_access;
+    // Instructions left before a DEBUGGER_STEPPED stop.
+    uint64_t steps_left;
+    // Set at the start of a run, so that continuing from a breakpoint
+    // steps over it.
+    uint8_t resuming;
+    // Address of the instruction that made the last stop.
+    uint16_t stop_pc;
+};
+
+void debugger_attach(struct gameboy_emulator_t *emulator, struct debugger_t *debugger)
+{
+    memset(debugger, 0, sizeof(*debugger));
+    debugger->steps_left = UINT64_MAX;
+    emulator->debugger = debugger;
+    memory_update_page_traps(emulator);
+}
+
+void debugger_set_breakpoint(struct gameboy_emulator_t *emulator, uint16_t addr, uint8_t enable)
+{
+    if (enable) emulator->debugger->breakpoints[addr >> 3] |= 1 << (addr & 0x07);
+    else emulator->debugger->breakpoints[addr >> 3] &= ~(1 << (addr & 0x07));
+}
+
+static void debugger_set_page_traps(struct gameboy_emulator_t *emulator)
+{
+    struct debugger_t *debugger = emulator->debugger;
+    int i, page;
+
+    for (i = 0; i < DEBUGGER_WATCHPOINTS; i++)
+    {
+        struct watchpoint_t *watch = &debugger->watchpoints[i];
+        if (!watch->access) continue;
+        for (page = watch->start >> 0x08; page <= watch->end >> 0x08; page++)
+            emulator->memory.page_traps[page] |= watch->access;
+    }
+}
+
+int debugger_add_watchpoint(struct gameboy_emulator_t *emulator, uint16_t start, uint16_t end, uint8_t access)
+{
+    // Returns the watchpoint index, or -1 when all slots are taken.
+    struct debugger_t *debugger = emulator->debugger;
+    int i;
+
+    for (i = 0; i < DEBUGGER_WATCHPOINTS; i++)
+    {
+        if (debugger->watchpoints[i].access) continue;
+        debugger->watchpoints[i].start  = start < end ? start : end;
+        debugger->watchpoints[i].end    = start < end ? end : start;
+        debugger->watchpoints[i].access = access & (TRAP_READ | TRAP_WRITE);
+        memory_update_page_traps(emulator);
+        return i;
+    }
+    return -1;
+}
+
+void debugger_remove_watchpoint(struct gameboy_emulator_t *emulator, int index)
+{
+    if (index < 0 || index >= DEBUGGER_WATCHPOINTS) return;
+    emulator->debugger->watchpoints[index].access = 0;
+    memory_update_page_traps(emulator);
+}
+
+static void debugger_trap(struct gameboy_emulator_t *emulator, uint16_t addr, uint8_t access)
+{
+    struct debugger_t *debugger = emulator->debugger;
+    int i;
+
+    for (i = 0; i < DEBUGGER_WATCHPOINTS; i++)
+    {
+        struct watchpoint_t *watch = &debugger->watchpoints[i];
+        if (!(watch->access & access) || addr < watch->start || addr > watch->end) continue;
+        if (!debugger->stop)
+        {
+            debugger->stop         = DEBUGGER_WATCHPOINT;
+            debugger->watch_addr   = addr;
+            debugger->watch_access = access;
+            emulator->slice_end    = 0;
+        }
+        return;
+    }
+}
+
+static void debugger_resume(struct gameboy_emulator_t *emulator)
+{
+    emulator->debugger->stop = 0;
+    emulator->debugger->resuming = 1;
+}
+
+static int debugger_stopped(const struct gameboy_emulator_t *emulator)
+{
+    return emulator->debugger->stop != 0;
+}
+
+static inline int debugger_stop(struct gameboy_emulator_t *emulator)
+{
+    // Called by the debugger variant of the core before every
+    // instruction. Returns nonzero to end the slice in front of it.
+    struct debugger_t *debugger = emulator->debugger;
+    uint16_t pc = emulator->cpu.reg.pc.data;
+
+    debugger->stop_pc = pc;
+    if (!debugger->steps_left) debugger->stop = DEBUGGER_STEPPED;
+    else if (!debugger->resuming && (debugger->breakpoints[pc >> 3] & (1 << (pc & 0x07)))) debugger->stop = DEBUGGER_BREAKPOINT;
+    if (debugger->stop) return 1;
+    debugger->steps_left--;
+    debugger->resuming = 0;
+    return 0;
+}
+
+int debugger_run(struct gameboy_emulator_t *emulator, uint64_t max_steps)
+{
+    // Executes up to max_steps instructions and returns why it
+    // stopped. A breakpoint on the first instruction is stepped over,
+    // so that continuing from a breakpoint makes progress.
+    struct debugger_t *debugger = emulator->debugger;
+    struct run_condition_t condition = { 0 };
+
+    debugger->steps_left = max_steps;
+    emulator_run_until(emulator, &condition);
+    debugger->steps_left = UINT64_MAX;
+    if (!debugger->stop) debugger->stop_pc = emulator->cpu.reg.pc.data;
+    return debugger->stop ? debugger->stop : DEBUGGER_STEPPED;
+}
+
+static void debugger_dump_memory(struct gameboy_emulator_t *emulator, uint16_t addr, uint32_t length)
+{
+    uint32_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        uint16_t at = (addr + i) & 0xffff;
+        if (i % 16 == 0) printf("%s%04x:", i ? "\n" : "", at);
+        printf(" %02x", emulator->memory.blocks[at]);
+    }
+    printf("\n");
+}
+
+void debugger_console(struct gameboy_emulator_t *emulator)
+{
+    // Commands, addresses in hex:
+    //  s [n]               step n instructions (default 1)
+    //  c [n]               continue, at most n instructions
+    //  r                   dump registers
+    //  m addr [len]        dump memory
+    //  b addr              toggle a breakpoint
+    //  w addr [end] [r|w]  add a watchpoint (default both)
+    //  d index             delete a watchpoint
+    //  j buttons           hold the JOYPAD_* buttons (0 releases all)
+    //  q                   quit
+    struct debugger_t *debugger = emulator->debugger;
+    char line[256];
+
+    for (;;)
+    {
+        char *args[4] = { "", NULL, NULL, NULL };
+        int count = 0;
+        char *token;
+
+        printf("(gb $%04x) ", emulator->cpu.reg.pc.data);
+        fflush(stdout);
+        if (!fgets(line, sizeof(line), stdin)) return;
+        for (token = strtok(line, " \t\n"); token && count < 4; token = strtok(NULL, " \t\n"))
+            args[count++] = token;
+
+        switch (args[0][0])
+        {
+            case 's':
+            case 'c':
+            {
+                uint64_t steps = args[1] ? strtoull(args[1], NULL, 0) : (args[0][0] == 's' ? 1 : UINT64_MAX);
+                switch (debugger_run(emulator, steps))
+                {
+                    case DEBUGGER_BREAKPOINT:
+                        printf("[INFO ] Breakpoint at $%04x\n", debugger->stop_pc);
+                        break;
+                    case DEBUGGER_WATCHPOINT:
+                        printf("[INFO ] Watchpoint %s of $%04x by instruction at $%04x\n",
+                               debugger->watch_access == TRAP_READ ? "read" : "write",
+                               debugger->watch_addr, debugger->stop_pc);
+                        break;
+                }
+                break;
+            }
+            case 'r':
+                dum_cpu_registers(emulator);
+                break;
+            case 'm':
+                if (!args[1]) break;
+                debugger_dump_memory(emulator, strtoul(args[1], NULL, 16), args[2] ? strtoul(args[2], NULL, 16) : 0x40);
+                break;
+            case 'b':
+            {
+                uint16_t addr;
+                uint8_t set;
+                if (!args[1]) break;
+                addr = strtoul(args[1], NULL, 16);
+                set = !(debugger->breakpoints[addr >> 3] & (1 << (addr & 0x07)));
+                debugger_set_breakpoint(emulator, addr, set);
+                printf("[INFO ] Breakpoint $%04x %s\n", addr, set ? "set" : "cleared");
+                break;
+            }
+            case 'w':
+            {
+                // The access letters are not hex digits, so an optional
+                // end address and access mode never get confused.
+                const char *mode = "rw";
+                uint16_t start, end;
+                uint8_t access = 0;
+                if (!args[1]) break;
+                start = end = strtoul(args[1], NULL, 16);
+                if (args[2] && strspn(args[2], "rw") == strlen(args[2])) mode = args[2];
+                else if (args[2]) end = strtoul(args[2], NULL, 16);
+                if (args[3]) mode = args[3];
+                if (strchr(mode, 'r')) access |= TRAP_READ;
+                if (strchr(mode, 'w')) access |= TRAP_WRITE;
+                printf("[INFO ] Watchpoint %d\n", debugger_add_watchpoint(emulator, start, end, access));
+                break;
+            }
+            case 'd':
+                if (args[1]) debugger_remove_watchpoint(emulator, atoi(args[1]));
+                break;
+            case 'j':
+                if (args[1]) emulator_set_buttons(emulator, strtoul(args[1], NULL, 16));
+                break;
+            case 'q':
+                return;
+            default:
+                printf("[INFO ] Commands: s [n], c [n], r, m addr [len], b addr, w addr [end] [r|w], d index, j buttons, q\n");
+                break;
+        }
+    }
+}
+
+// Boot
+//
+// Running the boot ROM costs about 2.5 seconds of emulated time per
+// cartridge. BOOT_SKIP starts at $0100 with the state the boot ROM
+// leaves behind, built directly. BOOT_CACHED runs the real boot ROM
+// once per boot ROM and cartridge header, then restores the saved
+// state file on later runs.
+// For more details: https://gbdev.io/pandocs/Power_Up_Sequence.html
+#define BOOT_FULL               0
+#define BOOT_SKIP               1
+#define BOOT_CACHED             2
+
+#define BOOT_MAX_CYCLES         (4194304ull * 10)
+
+#define STATE_MAGIC             0x54534247      // "GBST"
+#define STATE_VERSION           1
+#define STATE_MAX_CLOCK_SKEW    (CLOCKS_PER_LINE * LINES_PER_FRAME)
+
+struct state_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+};
+
+static void emulator_copy_state(struct gameboy_emulator_t *dst, const struct gameboy_emulator_t *src)
+{
+    // Machine state only; attached tools and trap flags of dst stay.
+    struct profiler_t *profiler = dst->profiler;
+    struct debugger_t *debugger = dst->debugger;
+    struct hash_log_t *hash_log = dst->hash_log;
+    struct movie_t *movie = dst->movie;
+    struct link_port_t *link = dst->link;
+    struct metrics_t *metrics = dst->metrics;
+    struct audio_output_t *output = dst->apu.output;
+    struct frame_buffers_t *frames_out = dst->ppu.frames_out;
+    uint8_t *framebuffer = dst->ppu.framebuffer;
+    const char *tag = dst->cpu.tag;
+    uint8_t trace = dst->trace;
+    uint8_t contain_faults = dst->contain_faults;
+
+    memcpy(dst, src, sizeof(*dst));
+    dst->profiler = profiler;
+    dst->debugger = debugger;
+    dst->hash_log = hash_log;
+    dst->movie = movie;
+    dst->link = link;
+    dst->metrics = metrics;
+    dst->trace = trace;
+    dst->contain_faults = contain_faults;
+    dst->ppu.frames_out = frames_out;
+    dst->ppu.framebuffer = framebuffer;
+    dst->cpu.tag = tag;
+    dst->run_watch = 0;
+    dst->apu.output = NULL;
+    emulator_map_registers(dst);
+    memory_update_page_traps(dst);
+    if (output) apu_attach_output(dst, output, output->ring, output->sample_rate);
+}
+
+static int state_clock_near(uint64_t clock, uint64_t cycles, uint64_t span)
+{
+    return clock >= cycles ? clock - cycles <= span : cycles - clock <= span;
+}
+
+static int emulator_state_valid(const struct gameboy_emulator_t *state)
+{
+    // States come from files and from server clients. Any field used
+    // as an index, shift or step must be in range before the state is
+    // copied in; pointers are never taken from it. Device clocks must
+    // be within a frame of the CPU's, or catching up would step for
+    // ages, or never reach the next event. Channel clocks only run
+    // with an audio output, and attaching one restarts them from the
+    // APU clock.
+    uint64_t cycles = state->cycles;
+    int n;
+
+    if (state->memory.size != MAIN_MEORY_SIZE) return 0;
+    if (!state_clock_near(state->next_event, cycles, STATE_MAX_CLOCK_SKEW) ||
+        !state_clock_near(state->slice_end, cycles, STATE_MAX_CLOCK_SKEW) ||
+        !state_clock_near(state->ppu.line_start, cycles, STATE_MAX_CLOCK_SKEW) ||
+        !state_clock_near(state->apu.clock, cycles, STATE_MAX_CLOCK_SKEW) ||
+        !state_clock_near(state->apu.next_tick, cycles, STATE_MAX_CLOCK_SKEW)) return 0;
+    if (state->serial.transfer_end && !state_clock_near(state->serial.transfer_end, cycles, SERIAL_TRANSFER_CLOCKS)) return 0;
+    if (state->cgb.vram_bank > 1 || state->cgb.wram_bank > 7) return 0;
+    if (state->cgb.hdma_destination & ~0x1ff0 || state->cgb.hdma_blocks > 0x80) return 0;
+    if (state->ppu.window_line > SCREEN_HEIGHT) return 0;
+    if (state->apu.sequencer_step > 7) return 0;
+    for (n = 0; n < 4; n++)
+    {
+        const struct apu_channel_t *channel = &state->apu.channel[n];
+
+        if (channel->position > (n == 2 ? 0x1f : 0x07)) return 0;
+        if (channel->duty > 3 || channel->wave_shift > 4 || channel->volume > 15 || channel->output > 15) return 0;
+        // A running channel with no period would step forever.
+        if (channel->enabled && channel->period == 0) return 0;
+    }
+    return 1;
+}
+
+static int emulator_write_state(struct gameboy_emulator_t *emulator, FILE *file)
+{
+    struct state_header_t header = { STATE_MAGIC, STATE_VERSION, sizeof(*emulator) };
+
+    return fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(emulator, sizeof(*emulator), 1, file) == 1 ? 0 : -1;
+}
+
+static int emulator_read_state(struct gameboy_emulator_t *emulator, FILE *file)
+{
+    // The state is staged on the heap, so loads on different threads
+    // do not share a buffer.
+    struct gameboy_emulator_t *state = malloc(sizeof(*state));
+    struct state_header_t header;
+    int result = -1;
+
+    if (state == NULL) return -1;
+    if (fread(&header, sizeof(header), 1, file) == 1 &&
+        header.magic == STATE_MAGIC && header.version == STATE_VERSION && header.size == sizeof(*state) &&
+        fread(state, sizeof(*state), 1, file) == 1 && emulator_state_valid(state))
+    {
+        emulator_copy_state(emulator, state);
+        result = 0;
+    }
+    free(state);
+    return result;
+}
+
+int emulator_save_state_file(struct gameboy_emulator_t *emulator, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    int ok;
+
+    if (file == NULL) return -1;
+    ok = emulator_write_state(emulator, file) == 0;
+    return (fclose(file) == 0 && ok) ? 0 : -1;
+}
+
+int emulator_load_state_file(struct gameboy_emulator_t *emulator, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    int result;
+
+    if (file == NULL) return -1;
+    result = emulator_read_state(emulator, file);
+    fclose(file);
+    return result;
+}
+
+static void boot_decompress_logo(struct gameboy_emulator_t *emulator, const uint8_t *logo)
+{
+    // The boot ROM scales every logo nibble to 8 pixels wide and two
+    // rows high, on bit plane 0 only: each logo byte fills half a tile.
+    uint16_t addr = 0x8010;
+    int i, half, bit;
+
+    for (i = 0; i < 48; i++)
+    {
+        for (half = 0; half < 2; half++)
+        {
+            uint8_t nibble = (logo[i] >> (half ? 0 : 4)) & 0x0f;
+            uint8_t row = 0;
+            for (bit = 3; bit >= 0; bit--) row = (row << 2) | (((nibble >> bit) & 0x01) * 0x03);
+            emulator->memory.blocks[addr + 0] = row;
+            emulator->memory.blocks[addr + 2] = row;
+            addr += 4;
+        }
+    }
+
+    // The (R) trademark tile, stored as 8 rows in the boot ROM.
+    for (i = 0; i < 8; i++) emulator->memory.blocks[0x8190 + i * 2] = boot_rom[0xd8 + i];
+
+    // Tile map: logo tiles 1-12 and 13-24 on two rows, (R) after them.
+    for (i = 0; i < 12; i++)
+    {
+        emulator->memory.blocks[0x9904 + i] = 0x01 + i;
+        emulator->memory.blocks[0x9924 + i] = 0x0d + i;
+    }
+    emulator->memory.blocks[0x9910] = 0x19;
+}
+
+void emulator_skip_boot(struct gameboy_emulator_t *emulator)
+{
+    // emulator_initialize() already sets the post-boot registers and
+    // I/O. What is left is what the boot ROM draws and the handoff.
+    boot_decompress_logo(emulator, &emulator->memory.rom[0x0104]);
+    emulator->memory.blocks[0xff50] = 0x01;
+    boot_rom_unmap(emulator);
+    emulator->cpu.reg.pc.data = 0x0100;
+}
+
+static uint64_t boot_state_key(struct gameboy_emulator_t *emulator)
+{
+    // FNV-1a over the mapped boot ROM, the cartridge bytes under it
+    // and the rest of the ROM. The saved state holds the whole ROM
+    // image, so cartridges that only share a header must not share it.
+    uint64_t hash = 14695981039346656037ull;
+    uint32_t addr;
+
+    for (addr = 0x0000; addr < ROM_SIZE; addr++)
+        hash = (hash ^ emulator->memory.blocks[addr]) * 1099511628211ull;
+    for (addr = 0x0000; addr < sizeof(emulator->memory.cartridge_head); addr++)
+        hash = (hash ^ emulator->memory.cartridge_head[addr]) * 1099511628211ull;
+    return hash;
+}
+
+int emulator_boot(struct gameboy_emulator_t *emulator, int mode, const char *cache_dir)
+{
+    // Call after emulator_load_rom(). Returns -1 if the boot ROM did
+    // not hand over to the cartridge, e.g. on a bad header checksum.
+    char path[1024];
+
+    // There is only the DMG boot ROM, which would tell a CGB cartridge
+    // it runs on a DMG. CGB mode always starts from the handoff state.
+    if (emulator->cgb.enabled) mode = BOOT_SKIP;
+    if (mode == BOOT_FULL) return 0;
+    if (mode == BOOT_SKIP)
+    {
+        emulator_skip_boot(emulator);
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/boot-%016llx.state", cache_dir ? cache_dir : ".",
+             (unsigned long long) boot_state_key(emulator));
+    if (emulator_load_state_file(emulator, path) == 0) return 0;
+
+    if (emulator_run_until_pc(emulator, 0x0100, BOOT_MAX_CYCLES) != RUN_UNTIL_PC || emulator->memory.boot_rom_mapped)
+        return -1;
+    if (emulator_save_state_file(emulator, path) != 0)
+        printf("[WARN ] Cannot write boot state cache %s.\n", path);
+    return 0;
+}
+
+// Input movies
+//
+// A movie is a start state followed by the joypad changes only, each
+// keyed by the clock it happened at (and the frame, for people reading
+// it). Playback makes the next change a scheduler event. Each change
+// lands on the same instruction boundary where it was recorded, so
+// replays are bit exact and run at full speed. Nothing in the machine
+// reads the host clock.
+#define MOVIE_MAGIC             0x564d4247      // "GBMV"
+#define MOVIE_VERSION           1
+
+struct movie_header_t {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct movie_event_t {
+    uint64_t cycle;
+    uint32_t frame;
+    uint8_t buttons;
+    uint8_t reserved[3];
+};
+
+struct movie_t {
+    FILE *file;
+    uint8_t recording;
+    // Playback: the next change, while one is pending.
+    uint8_t pending;
+    struct movie_event_t next;
+    uint64_t events;
+};
+
+int movie_record_start(struct gameboy_emulator_t *emulator, struct movie_t *movie, const char *path)
+{
+    // Starts from the current state; input then goes through
+    // emulator_set_buttons().
+    struct movie_header_t header = { MOVIE_MAGIC, MOVIE_VERSION };
+
+    memset(movie, 0, sizeof(*movie));
+    if ((movie->file = fopen(path, "wb")) == NULL) return -1;
+    if (fwrite(&header, sizeof(header), 1, movie->file) != 1 || emulator_write_state(emulator, movie->file) != 0)
+    {
+        fclose(movie->file);
+        return -1;
+    }
+    movie->recording = 1;
+    emulator->movie = movie;
+    return 0;
+}
+
+static void movie_read_event(struct movie_t *movie)
+{
+    movie->pending = fread(&movie->next, sizeof(movie->next), 1, movie->file) == 1;
+}
+
+int movie_play_start(struct gameboy_emulator_t *emulator, struct movie_t *movie, const char *path)
+{
+    // Replaces the machine state with the movie's start state.
+    struct movie_header_t header;
+
+    memset(movie, 0, sizeof(*movie));
+    if ((movie->file = fopen(path, "rb")) == NULL) return -1;
+    if (fread(&header, sizeof(header), 1, movie->file) != 1 || header.magic != MOVIE_MAGIC ||
+        header.version != MOVIE_VERSION || emulator_read_state(emulator, movie->file) != 0)
+    {
+        printf("[ERROR] %s is not a movie for this build.\n", path);
+        fclose(movie->file);
+        return -1;
+    }
+    movie_read_event(movie);
+    emulator->movie = movie;
+    if (movie->pending && movie->next.cycle < emulator->next_event) emulator->next_event = movie->next.cycle;
+    return 0;
+}
+
+void movie_stop(struct gameboy_emulator_t *emulator)
+{
+    struct movie_t *movie = emulator->movie;
+
+    if (movie == NULL) return;
+    fclose(movie->file);
+    movie->file = NULL;
+    movie->pending = 0;
+    emulator->movie = NULL;
+}
+
+static uint64_t movie_step(struct gameboy_emulator_t *emulator)
+{
+    // Applies the changes that are due; returns the clock of the next.
+    struct movie_t *movie = emulator->movie;
+
+    while (movie->pending && movie->next.cycle <= emulator->cycles)
+    {
+        joypad_press(emulator, movie->next.buttons);
+        movie->events++;
+        movie_read_event(movie);
+    }
+    return movie->pending ? movie->next.cycle : UINT64_MAX;
+}
+
+void emulator_set_buttons(struct gameboy_emulator_t *emulator, uint8_t buttons)
+{
+    // Sets the JOYPAD_* buttons held, from between instructions.
+    // Recorded if a movie is recording, ignored while one plays.
+    struct movie_t *movie = emulator->movie;
+
+    if (movie && !movie->recording) return;
+    if (buttons == emulator->joypad.buttons) return;
+    if (movie)
+    {
+        struct movie_event_t event = { emulator->cycles, (uint32_t) emulator->ppu.frames, buttons, { 0, 0, 0 } };
+        fwrite(&event, sizeof(event), 1, movie->file);
+        movie->events++;
+    }
+    joypad_press(emulator, buttons);
+}
+
+#ifndef GB_LIBRARY
+// Benchmarks
+//
+// Micro benchmarks place a synthetic instruction stream for one
+// instruction family in ROM, repeat it up to $3FFF and close it
+// with a JP back to $0100, so the dispatch loop never leaves the
+// family being measured. Macro benchmarks run whole guest programs.
+// Each sample runs through emulator_run_until(), the loop games run
+// in, for a budget of clocks or up to a PC, and counts the
+// instructions it retired. Every benchmark reports a row per core
+// variant it runs on, since core_select() picks the variant from the
+// machine: DMG, CGB, or debug with a profiler attached.
+// Every benchmark is sampled several times and reported as the
+// median with a 95% confidence interval (order statistics, so no
+// assumption about the shape of the timing noise).
+#define BENCHMARK_SAMPLES           15
+#define BENCHMARK_MICRO_CYCLES      (CPU_CLOCK * 8)
+#define BENCHMARK_MACRO_CYCLES      (CPU_CLOCK * 8)
+#define BENCHMARK_STREAM_START      0x0100
+#define BENCHMARK_STREAM_END        0x4000
+#define BENCHMARK_SUBROUTINE        0x0080
+#define BENCHMARK_REGRESSION_PCT    5.0
+#define BENCHMARK_CORE_DMG          0x01
+#define BENCHMARK_CORE_CGB          0x02
+#define BENCHMARK_CORE_DEBUG        0x04
+#define BENCHMARK_CORES_ALL         0x07
+#define TRAIN_FRAMES                120
+#define TRAIN_STEPS                 1000000
+
+struct benchmark_t {
+    const char *name;
+    const char *family;
+    // Either a repeated instruction stream ...
+    const uint8_t *stream;
+    uint16_t length;
+    // ... whose JP nn operands are patched to the next copy ...
+    uint8_t chain_jumps;
+    // ... or a loader for a complete guest program.
+    void (*load)(struct gameboy_emulator_t *emulator);
+    struct run_condition_t until;
+    uint8_t cores;              // BENCHMARK_CORE_* variants to run on.
+};
+
+struct benchmark_result_t {
+    const char *name;
+    const char *core;
+    uint64_t instructions;      // Retired per sample.
+    double median_mips;
+    double ci_low_mips;
+    double ci_high_mips;
+};
+
+static const struct { uint8_t core; const char *name; } benchmark_cores[] =
+{
+    { BENCHMARK_CORE_DMG, "dmg" }, { BENCHMARK_CORE_CGB, "cgb" }, { BENCHMARK_CORE_DEBUG, "debug" },
+};
+
+static const uint8_t bench_ld_r_r[]   = { 0x78, 0x41, 0x4a, 0x53, 0x5c, 0x65, 0x68, 0x47 };
+static const uint8_t bench_ld_r_n[]   = { 0x06, 0x12, 0x0e, 0x34, 0x16, 0x56, 0x1e, 0x78, 0x3e, 0x9a };
+static const uint8_t bench_ld_r_hl[]  = { 0x7e, 0x46, 0x4e, 0x56, 0x5e };
+static const uint8_t bench_ld_hl_r[]  = { 0x70, 0x71, 0x72, 0x73, 0x77 };
+static const uint8_t bench_alu[]      = { 0x80, 0x91, 0xa2, 0xb3, 0xa8, 0xb9, 0xfe, 0x42 };
+static const uint8_t bench_inc_dec[]  = { 0x04, 0x05, 0x0c, 0x0d, 0x14, 0x15, 0x3c, 0x3d };
+static const uint8_t bench_rotate[]   = { 0x07, 0x17, 0x0f, 0x1f };
+static const uint8_t bench_cb_shift[] = { 0xcb, 0x00, 0xcb, 0x11, 0xcb, 0x0a, 0xcb, 0x1b, 0xcb, 0x27, 0xcb, 0x2c, 0xcb, 0x3d };
+static const uint8_t bench_cb_bit[]   = { 0xcb, 0x40, 0xcb, 0x7c, 0xcb, 0x87, 0xcb, 0xc1, 0xcb, 0xff };
+static const uint8_t bench_jp[]       = { 0xc3, 0x00, 0x00 };
+static const uint8_t bench_jr[]       = { 0x18, 0x00, 0x20, 0x00, 0x28, 0x00 };
+static const uint8_t bench_call_ret[] = { 0xcd, BENCHMARK_SUBROUTINE, 0x00 };
+static const uint8_t bench_push_pop[] = { 0xc5, 0xd5, 0xe5, 0xc1, 0xd1, 0xe1 };
+
+static void benchmark_load_cartridge(struct gameboy_emulator_t *emulator, uint8_t cgb)
+{
+    // A cartridge the boot ROM accepts: its logo, a valid header
+    // checksum, and JR -2 at the entry point with the LCD left on.
+    static uint8_t image[0x8000];
+    uint8_t checksum = 0;
+    int i;
+
+    memset(image, 0, sizeof(image));
+    memcpy(&image[0x0104], &boot_rom[0xa8], 0x30);
+    image[0x0143] = cgb ? 0x80 : 0x00;
+    for (i = 0x0134; i < 0x014d; i++) checksum = checksum - image[i] - 1;
+    image[0x014d] = checksum;
+    image[0x0100] = 0x18;
+    image[0x0101] = 0xfe;
+
+    emulator_initialize(emulator);
+    emulator_load_rom_data(emulator, image, sizeof(image));
+}
+
+static void benchmark_load_boot_rom(struct gameboy_emulator_t *emulator)
+{
+    // The whole boot ROM: logo scroll, sound and the header checks,
+    // run until it hands over at $0100.
+    benchmark_load_cartridge(emulator, 0);
+}
+
+static void benchmark_load_frame_loop(struct gameboy_emulator_t *emulator)
+{
+    // A typical game main loop: copy a 160 byte shadow OAM table,
+    // then burn the rest of the frame in nested delay loops.
+    static const uint8_t program[] =
+    {
+        0x21, 0x00, 0xc0,       // $0100    LD HL, $C000
+        0x11, 0x00, 0xfe,       // $0103    LD DE, $FE00
+        0x06, 0xa0,             // $0106    LD B, $A0
+        0x2a,                   // $0108    LD A, (HL+)
+        0x12,                   // $0109    LD (DE), A
+        0x13,                   // $010A    INC DE
+        0x05,                   // $010B    DEC B
+        0x20, 0xfa,             // $010C    JR NZ, $0108
+        0x0e, 0x40,             // $010E    LD C, $40
+        0xcd, 0x20, 0x01,       // $0110    CALL $0120
+        0x0d,                   // $0113    DEC C
+        0x20, 0xfa,             // $0114    JR NZ, $0110
+        0xc3, 0x00, 0x01,       // $0116    JP $0100
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x3e, 0x10,             // $0120    LD A, $10
+        0x3d,                   // $0122    DEC A
+        0x20, 0xfd,             // $0123    JR NZ, $0122
+        0xc9,                   // $0125    RET
+    };
+
+    emulator_initialize(emulator);
+    boot_rom_unmap(emulator);
+    memcpy(&emulator->memory.blocks[BENCHMARK_STREAM_START], program, sizeof(program));
+    emulator->cpu.reg.pc.data = BENCHMARK_STREAM_START;
+}
+
+static const struct benchmark_t benchmarks[] =
+{
+    { "ld_r_r",     "load",     bench_ld_r_r,   sizeof(bench_ld_r_r),   0, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "ld_r_n",     "load",     bench_ld_r_n,   sizeof(bench_ld_r_n),   0, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "ld_r_hl",    "load",     bench_ld_r_hl,  sizeof(bench_ld_r_hl),  0, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "ld_hl_r",    "load",     bench_ld_hl_r,  sizeof(bench_ld_hl_r),  0, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "alu_a_r",    "alu",      bench_alu,      sizeof(bench_alu),      0, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "inc_dec_r",  "alu",      bench_inc_dec,  sizeof(bench_inc_dec),  0, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "rotate_a",   "alu",      bench_rotate,   sizeof(bench_rotate),   0, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "cb_shift",   "cb",       bench_cb_shift, sizeof(bench_cb_shift), 0, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "cb_bit",     "cb",       bench_cb_bit,   sizeof(bench_cb_bit),   0, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "jp_nn",      "jump",     bench_jp,       sizeof(bench_jp),       1, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "jr_cc_n",    "jump",     bench_jr,       sizeof(bench_jr),       0, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "call_ret",   "call",     bench_call_ret, sizeof(bench_call_ret), 0, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "push_pop",   "stack",    bench_push_pop, sizeof(bench_push_pop), 0, NULL, { RUN_UNTIL_CYCLES, BENCHMARK_MICRO_CYCLES }, BENCHMARK_CORES_ALL },
+    { "boot_rom",   "macro",    NULL, 0, 0, benchmark_load_boot_rom,    { RUN_UNTIL_PC | RUN_UNTIL_CYCLES, BOOT_MAX_CYCLES, 0x0100 },
+                                                                    BENCHMARK_CORE_DMG | BENCHMARK_CORE_DEBUG },
+    { "frame_loop", "macro",    NULL, 0, 0, benchmark_load_frame_loop,  { RUN_UNTIL_CYCLES, BENCHMARK_MACRO_CYCLES }, BENCHMARK_CORES_ALL },
+};
+
+static void benchmark_load_stream(struct gameboy_emulator_t *emulator, const struct benchmark_t *bench)
+{
+    uint16_t addr = BENCHMARK_STREAM_START;
+
+    emulator_initialize(emulator);
+    boot_rom_unmap(emulator);
+    memset(emulator->memory.rom, 0, ROM_SIZE);
+    emulator->memory.rom[BENCHMARK_SUBROUTINE] = 0xc9;   // RET
+
+    while (addr + bench->length + 3 <= BENCHMARK_STREAM_END)
+    {
+        memcpy(&emulator->memory.rom[addr], bench->stream, bench->length);
+        if (bench->chain_jumps)
+        {
+            emulator->memory.rom[addr + 1] = (addr + bench->length) & 0xff;
+            emulator->memory.rom[addr + 2] = ((addr + bench->length) >> 0x08) & 0xff;
+        }
+        addr += bench->length;
+    }
+    emulator->memory.rom[addr + 0] = 0xc3;              // JP $0100
+    emulator->memory.rom[addr + 1] = BENCHMARK_STREAM_START & 0xff;
+    emulator->memory.rom[addr + 2] = (BENCHMARK_STREAM_START >> 0x08) & 0xff;
+
+    // Keep (HL) and (DE) pointing at work RAM.
+    emulator->cpu.reg.pc.data = BENCHMARK_STREAM_START;
+    emulator->cpu.reg.hl.data = 0xc000;
+    emulator->cpu.reg.de.data = 0xc100;
+}
+
+static void benchmark_set_core(struct gameboy_emulator_t *emulator, uint8_t core)
+{
+    // Moves the loaded program onto the machine that selects the
+    // variant. CGB mode keeps the program's registers.
+    static struct profiler_t profiler;
+    struct cpu_core_t cpu = emulator->cpu;
+
+    if (core == BENCHMARK_CORE_CGB)
+    {
+        cgb_power_up(emulator);
+        emulator->cpu = cpu;
+    }
+    if (core == BENCHMARK_CORE_DEBUG) profiler_attach(emulator, &profiler);
+}
+
+static uint64_t benchmark_sample(struct gameboy_emulator_t *emulator, const struct benchmark_t *bench, uint8_t core, uint64_t *instructions)
+{
+    // Returns the host time taken, in nanoseconds.
+    struct metrics_t metrics;
+    uint64_t start;
+    uint8_t met;
+
+    if (bench->load) bench->load(emulator);
+    else benchmark_load_stream(emulator, bench);
+    benchmark_set_core(emulator, core);
+    memset(&metrics, 0, sizeof(metrics));
+    metrics_attach(emulator, &metrics);
+
+    start = host_time_ns();
+    met = emulator_run_until(emulator, &bench->until);
+    start = host_time_ns() - start;
+
+    if ((bench->until.flags & ~RUN_UNTIL_CYCLES) && !(met & ~RUN_UNTIL_CYCLES))
+        fprintf(stderr, "[WARN ] Benchmark %s ran out of clocks before its stop condition.\n", bench->name);
+
+    metrics_attach(emulator, NULL);
+    *instructions = metrics.instructions;
+    return start;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static double benchmark_sqrt(double x)
+{
+    // Newton's method, to keep the build free of -lm.
+    double r = x > 1.0 ? x : 1.0;
+    int i;
+    for (i = 0; i < 32; i++) r = 0.5 * (r + x / r);
+    return r;
+}
+
+static struct benchmark_result_t benchmark_run(struct gameboy_emulator_t *emulator, const struct benchmark_t *bench, int core)
+{
+    struct benchmark_result_t result;
+    uint64_t samples[BENCHMARK_SAMPLES];
+    double spread = 0.98 * benchmark_sqrt(BENCHMARK_SAMPLES);
+    int n = BENCHMARK_SAMPLES;
+    int low, high, i;
+
+    uint8_t mask = benchmark_cores[core].core;
+
+    benchmark_sample(emulator, bench, mask, &result.instructions);      // Warm up caches.
+    for (i = 0; i < n; i++) samples[i] = benchmark_sample(emulator, bench, mask, &result.instructions);
+    qsort(samples, n, sizeof(samples[0]), compare_u64);
+
+    // Ranks of the distribution-free 95% interval for the median.
+    low  = (int) (n / 2.0 - spread);
+    high = (int) (n / 2.0 + 1.0 + spread + 0.999);
+    if (low < 1) low = 1;
+    if (high > n) high = n;
+
+    // Fastest time gives the highest MIPS, so the bounds swap.
+    result.name         = bench->name;
+    result.core         = benchmark_cores[core].name;
+    result.median_mips  = result.instructions * 1000.0 / samples[n / 2];
+    result.ci_low_mips  = result.instructions * 1000.0 / samples[high - 1];
+    result.ci_high_mips = result.instructions * 1000.0 / samples[low - 1];
+    return result;
+}
+
+static int benchmark_compare(const struct benchmark_result_t *result, FILE *baseline, double *delta)
+{
+    // Baseline files are earlier --bench output. A benchmark only
+    // counts as regressed when the whole confidence interval sits
+    // below the baseline by more than the noise threshold.
+    char line[256];
+    char name[64];
+    char family[64];
+    char core[16];
+    unsigned long long instructions;
+    int count;
+    double median, ci_low, ci_high;
+
+    rewind(baseline);
+    while (fgets(line, sizeof(line), baseline))
+    {
+        if (sscanf(line, "%63[^,],%63[^,],%15[^,],%llu,%d,%lf,%lf,%lf",
+                   name, family, core, &instructions, &count, &median, &ci_low, &ci_high) != 8) continue;
+        if (strcmp(name, result->name) != 0 || strcmp(core, result->core) != 0) continue;
+
+        *delta = (result->median_mips - median) * 100.0 / median;
+        int regressed = result->ci_high_mips < ci_low && *delta < -BENCHMARK_REGRESSION_PCT;
+        fprintf(stderr, "%-12s %-6s %10.2f -> %10.2f MIPS  %+7.2f%%  %s\n",
+                result->name, result->core, median, result->median_mips, *delta, regressed ? "REGRESSED" : "ok");
+        return regressed;
+    }
+    fprintf(stderr, "%-12s %-6s not in baseline\n", result->name, result->core);
+    return -1;
+}
+
+static int profile_main(uint64_t frames, const char *prefix, const char *rom, int boot_mode, const char *cache_dir)
+{
+    // Profiles a cartridge through the same run loop as the CLI, which
+    // picks the profiling variant of the core while one is attached.
+    static struct gameboy_emulator_t emulator;
+    static struct profiler_t profiler;
+    static const char *suffixes[] = { ".flat", ".folded", ".coverage" };
+    static void (*writers[])(struct profiler_t*, FILE*) =
+    {
+        profiler_write_flat, profiler_write_folded, profiler_write_coverage
+    };
+    char path[1024];
+    uint64_t frame;
+    int n;
+
+    emulator_initialize(&emulator);
+    if (rom && emulator_load_rom(&emulator, rom) != 0) return 1;
+    if (emulator_boot(&emulator, boot_mode, cache_dir) != 0)
+    {
+        printf("[ERROR] Boot ROM did not reach the cartridge entry point.\n");
+        return 1;
+    }
+    profiler_attach(&emulator, &profiler);
+    for (frame = 0; frame < frames && !emulator.faulted; frame++) emulator_run_until_vblank(&emulator);
+    if (emulator.faulted) printf("[WARN ] Guest faulted on instruction $%x, profile ends there.\n", emulator.opcode);
+
+    for (n = 0; n < 3; n++)
+    {
+        FILE *out;
+        snprintf(path, sizeof(path), "%s%s", prefix, suffixes[n]);
+        if ((out = fopen(path, "w")) == NULL)
+        {
+            printf("[ERROR] Cannot write profile %s.\n", path);
+            return 2;
+        }
+        writers[n](&profiler, out);
+        fclose(out);
+    }
+    return 0;
+}
+
+static int benchmark_main(const char *baseline_path)
+{
+    static struct gameboy_emulator_t emulator;
+    FILE *baseline = NULL;
+    int regressions = 0, compared = 0;
+    double total_delta = 0.0;
+    size_t i, core;
+
+    if (baseline_path && (baseline = fopen(baseline_path, "r")) == NULL)
+    {
+        printf("[ERROR] Cannot open benchmark baseline %s.\n", baseline_path);
+        return 2;
+    }
+
+    printf("name,family,core,instructions,samples,median_mips,ci_low_mips,ci_high_mips\n");
+    for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+    for (core = 0; core < sizeof(benchmark_cores) / sizeof(benchmark_cores[0]); core++)
+    {
+        struct benchmark_result_t result;
+
+        if (!(benchmarks[i].cores & benchmark_cores[core].core)) continue;
+        result = benchmark_run(&emulator, &benchmarks[i], core);
+        printf("%s,%s,%s,%llu,%d,%.3f,%.3f,%.3f\n", benchmarks[i].name, benchmarks[i].family,
+               result.core, (unsigned long long) result.instructions, BENCHMARK_SAMPLES,
+               result.median_mips, result.ci_low_mips, result.ci_high_mips);
+        fflush(stdout);
+        if (baseline)
+        {
+            double delta;
+            int regressed = benchmark_compare(&result, baseline, &delta);
+
+            if (regressed < 0) continue;
+            regressions += regressed;
+            total_delta += delta;
+            compared++;
+        }
+    }
+
+    if (baseline)
+    {
+        if (compared) fprintf(stderr, "%-12s %36s  %+7.2f%%\n", "mean", "", total_delta / compared);
+        fclose(baseline);
+    }
+    return regressions ? 1 : 0;
+}
+
+static int train_main(void)
+{
+    // Training workload for profile guided builds: the boot ROM up to
+    // the cartridge, both renderers, and every benchmark stream through
+    // the scheduler's run loop on each core variant as well as the
+    // single step loop.
+    static struct gameboy_emulator_t emulator;
+    uint64_t start = host_time_ns();
+    uint64_t instructions;
+    size_t i, core;
+    int frame, step;
+
+    benchmark_load_cartridge(&emulator, 0);
+    if (emulator_run_until_pc(&emulator, 0x0100, BOOT_MAX_CYCLES) != RUN_UNTIL_PC)
+    {
+        printf("[ERROR] Training cartridge did not boot.\n");
+        return 1;
+    }
+    for (frame = 0; frame < TRAIN_FRAMES; frame++) emulator_run_until_vblank(&emulator);
+
+    benchmark_load_cartridge(&emulator, 1);
+    emulator_boot(&emulator, BOOT_SKIP, NULL);
+    for (frame = 0; frame < TRAIN_FRAMES; frame++) emulator_run_until_vblank(&emulator);
+
+    for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+    {
+        if (benchmarks[i].load) benchmarks[i].load(&emulator);
+        else benchmark_load_stream(&emulator, &benchmarks[i]);
+        for (frame = 0; frame < TRAIN_FRAMES; frame++) emulator_run_until_vblank(&emulator);
+        // cpu_step_emulator(), the single step entry point of library
+        // users and conformance runs, would otherwise be laid out as cold.
+        for (step = 0; step < TRAIN_STEPS; step++)
+        {
+            cpu_step_emulator(&emulator);
+            emulator_step_events(&emulator);
+        }
+        for (core = 0; core < sizeof(benchmark_cores) / sizeof(benchmark_cores[0]); core++)
+            if (benchmarks[i].cores & benchmark_cores[core].core)
+                benchmark_sample(&emulator, &benchmarks[i], benchmark_cores[core].core, &instructions);
+    }
+
+    printf("[INFO ] Training workload ran in %.2f s.\n", (host_time_ns() - start) / 1e9);
+    return 0;
+}
+#endif // GB_LIBRARY
+
+#ifndef GB_LIBRARY
+// Conformance
+//
+// Runs single step test vectors, one JSON file per opcode in the
+// layout of the SM83 SingleStepTests. Every case injects the registers
+// and the bytes it lists, executes one instruction on a flat 64 KB bus
+// and compares registers, the expected bytes and the clocks taken.
+// One worker per core parses and runs whole files on a machine of its
+// own, and mismatches are reported per opcode with the first failing
+// case. Every case runs on cpu_step_emulator() and on each variant of
+// the core in core_slices[], as a slice one clock long, and is
+// reported per variant. IME is not emulated, so it is not compared.
+// For more details: https://github.com/SingleStepTests/sm83
+#define CONFORMANCE_MAX_RAM         8
+#define CONFORMANCE_MAX_FILES       1024
+#define CONFORMANCE_MAX_THREADS     64
+#define CONFORMANCE_CORES           (CORE_SLICES + 1)   // cpu_step_emulator() first.
+
+struct conformance_state_t {
+    struct cpu_state_t cpu;
+    uint8_t ram_count;
+    uint16_t ram_addr[CONFORMANCE_MAX_RAM];
+    uint8_t ram_value[CONFORMANCE_MAX_RAM];
+};
+
+struct conformance_case_t {
+    char name[32];
+    struct conformance_state_t initial;
+    struct conformance_state_t final;
+    uint32_t clocks;
+};
+
+struct conformance_file_t {
+    char path[1024];
+    // $CB prefixed opcodes are $1xx.
+    uint16_t opcode;
+    uint32_t cases;
+    uint32_t passed[CONFORMANCE_CORES];
+    uint8_t unimplemented;
+    uint8_t unreadable;
+    char first_failure[CONFORMANCE_CORES][160];
+};
+
+struct conformance_t {
+    struct conformance_file_t *files;
+    int count;
+    _Atomic int next;
+    // Time spent executing cases, summed over the workers.
+    _Atomic uint64_t run_ns;
+};
+
+struct json_t {
+    const char *p;
+    const char *end;
+    int error;
+};
+
+static int json_peek(struct json_t *json)
+{
+    while (json->p < json->end && (*json->p == ' ' || *json->p == '\n' || *json->p == '\r' || *json->p == '\t')) json->p++;
+    return json->p < json->end ? *json->p : 0;
+}
+
+static int json_accept(struct json_t *json, char c)
+{
+    if (json_peek(json) != c) return 0;
+    json->p++;
+    return 1;
+}
+
+static void json_expect(struct json_t *json, char c)
+{
+    if (!json_accept(json, c)) json->error = 1;
+}
+
+static void json_string(struct json_t *json, char *out, size_t size)
+{
+    // Escapes are kept as they are; test names and keys have none.
+    size_t n = 0;
+
+    json_expect(json, '"');
+    while (!json->error && json->p < json->end && *json->p != '"')
+    {
+        if (*json->p == '\\' && json->p + 1 < json->end) json->p++;
+        if (n + 1 < size) out[n++] = *json->p;
+        json->p++;
+    }
+    if (size) out[n] = '\0';
+    json_expect(json, '"');
+}
+
+static long json_number(struct json_t *json)
+{
+    char *end;
+    long value;
+
+    json_peek(json);
+    value = strtol(json->p, &end, 10);
+    if (end == json->p) json->error = 1;
+    json->p = end;
+    return value;
+}
+
+static void json_skip(struct json_t *json)
+{
+    int c = json_peek(json);
+
+    if (c == '"') json_string(json, NULL, 0);
+    else if (c == '[' || c == '{')
+    {
+        char close = c == '[' ? ']' : '}';
+        json->p++;
+        if (json_accept(json, close)) return;
+        do
+        {
+            if (close == '}')
+            {
+                json_string(json, NULL, 0);
+                json_expect(json, ':');
+            }
+            json_skip(json);
+        } while (!json->error && json_accept(json, ','));
+        json_expect(json, close);
+    }
+    else if (c == 't' || c == 'f' || c == 'n')
+        while (json->p < json->end && *json->p >= 'a' && *json->p <= 'z') json->p++;
+    else json_number(json);
+}
+
+static void conformance_parse_state(struct json_t *json, struct conformance_state_t *state)
+{
+    static const char *names[] = { "pc", "sp", "a", "f", "b", "c", "d", "e", "h", "l", "ie" };
+    uint8_t *bytes[] = { NULL, NULL, &state->cpu.a, &state->cpu.f, &state->cpu.b, &state->cpu.c,
+                         &state->cpu.d, &state->cpu.e, &state->cpu.h, &state->cpu.l, &state->cpu.ie };
+    char key[8];
+    int i;
+
+    memset(state, 0, sizeof(*state));
+    json_expect(json, '{');
+    do
+    {
+        json_string(json, key, sizeof(key));
+        json_expect(json, ':');
+        if (strcmp(key, "ram") == 0)
+        {
+            json_expect(json, '[');
+            if (json_accept(json, ']')) continue;
+            do
+            {
+                long addr, value;
+                json_expect(json, '[');
+                addr = json_number(json);
+                json_expect(json, ',');
+                value = json_number(json);
+                json_expect(json, ']');
+                if (state->ram_count == CONFORMANCE_MAX_RAM) json->error = 1;
+                if (json->error) return;
+                state->ram_addr[state->ram_count] = addr;
+                state->ram_value[state->ram_count++] = value;
+            } while (json_accept(json, ','));
+            json_expect(json, ']');
+            continue;
+        }
+        for (i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++)
+            if (strcmp(key, names[i]) == 0) break;
+        if (i == 0) state->cpu.pc = json_number(json);
+        else if (i == 1) state->cpu.sp = json_number(json);
+        else if (i < (int) (sizeof(names) / sizeof(names[0]))) *bytes[i] = json_number(json);
+        else json_skip(json);
+    } while (!json->error && json_accept(json, ','));
+    json_expect(json, '}');
+}
+
+static struct conformance_case_t *conformance_parse_file(const char *path, uint32_t *count)
+{
+    // Returns the cases of a test file, NULL if it cannot be read.
+    struct conformance_case_t *cases = NULL;
+    uint32_t capacity = 0;
+    struct json_t json;
+    char *text;
+    long size;
+    FILE *file = fopen(path, "rb");
+
+    *count = 0;
+    if (file == NULL) return NULL;
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    text = malloc(size > 0 ? size : 1);
+    if (size <= 0 || fread(text, 1, size, file) != (size_t) size)
+    {
+        fclose(file);
+        free(text);
+        return NULL;
+    }
+    fclose(file);
+
+    json.p = text;
+    json.end = text + size;
+    json.error = 0;
+    json_expect(&json, '[');
+    if (!json_accept(&json, ']'))
+    {
+        do
+        {
+            struct conformance_case_t *test;
+            char key[16];
+
+            if (*count == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 1024;
+                cases = realloc(cases, capacity * sizeof(*cases));
+            }
+            test = &cases[(*count)++];
+            memset(test, 0, sizeof(*test));
+            json_expect(&json, '{');
+            do
+            {
+                json_string(&json, key, sizeof(key));
+                json_expect(&json, ':');
+                if (strcmp(key, "name") == 0) json_string(&json, test->name, sizeof(test->name));
+                else if (strcmp(key, "initial") == 0) conformance_parse_state(&json, &test->initial);
+                else if (strcmp(key, "final") == 0) conformance_parse_state(&json, &test->final);
+                else if (strcmp(key, "cycles") == 0)
+                {
+                    // One entry per machine cycle of 4 clocks.
+                    json_expect(&json, '[');
+                    if (!json_accept(&json, ']'))
+                    {
+                        do
+                        {
+                            json_skip(&json);
+                            test->clocks += 4;
+                        } while (!json.error && json_accept(&json, ','));
+                        json_expect(&json, ']');
+                    }
+                }
+                else json_skip(&json);
+            } while (!json.error && json_accept(&json, ','));
+            json_expect(&json, '}');
+        } while (!json.error && json_accept(&json, ','));
+        json_expect(&json, ']');
+    }
+    free(text);
+    if (json.error)
+    {
+        free(cases);
+        *count = 0;
+        return NULL;
+    }
+    return cases;
+}
+
+static int conformance_check(struct gameboy_emulator_t *emulator, const struct conformance_case_t *test,
+                             uint32_t clocks, char *report, size_t size)
+{
+    static const char *names[] = { "pc", "sp", "a", "f", "b", "c", "d", "e", "h", "l", "ie" };
+    const struct cpu_state_t *want = &test->final.cpu;
+    struct cpu_state_t cpu;
+    int i;
+
+    emulator_extract_state(emulator, &cpu);
+    {
+        uint16_t got[] = { cpu.pc, cpu.sp, cpu.a, cpu.f, cpu.b, cpu.c, cpu.d, cpu.e, cpu.h, cpu.l, cpu.ie };
+        uint16_t expected[] = { want->pc, want->sp, want->a, want->f, want->b, want->c, want->d, want->e, want->h, want->l, want->ie };
+
+        for (i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++)
+        {
+            if (got[i] == expected[i]) continue;
+            snprintf(report, size, "%s: %s $%x, expected $%x", test->name, names[i], got[i], expected[i]);
+            return 0;
+        }
+    }
+    for (i = 0; i < test->final.ram_count; i++)
+    {
+        uint8_t value = emulator->memory.blocks[test->final.ram_addr[i]];
+        if (value == test->final.ram_value[i]) continue;
+        snprintf(report, size, "%s: ($%04x) $%02x, expected $%02x", test->name, test->final.ram_addr[i], value, test->final.ram_value[i]);
+        return 0;
+    }
+    if (clocks != test->clocks)
+    {
+        snprintf(report, size, "%s: %u clocks, expected %u", test->name, clocks, test->clocks);
+        return 0;
+    }
+    return 1;
+}
+
+static const char *const conformance_cores[CONFORMANCE_CORES] =
+{
+    "step", "dmg", "cgb", "debug", "debugger", "dmg_pc", "cgb_pc", "debug_pc", "debugger_pc",
+};
+
+static void conformance_step(struct gameboy_emulator_t *emulator, int core)
+{
+    // One instruction: a slice ends at the first instruction boundary
+    // at or past slice_end, and the PC variants are given a stop PC
+    // that is not the current one.
+    uint16_t pc = emulator->cpu.reg.pc.data;
+
+    if (core == 0)
+    {
+        cpu_step_emulator(emulator);
+        return;
+    }
+    emulator->slice_end = emulator->cycles + 1;
+    core_slices[core - 1](emulator, (uint16_t) ~pc);
+}
+
+static void conformance_run_file(struct gameboy_emulator_t *emulator, struct conformance_file_t *file, uint64_t *run_ns)
+{
+    struct conformance_case_t *cases = conformance_parse_file(file->path, &file->cases);
+    uint64_t start = host_time_ns();
+    uint32_t i;
+    int j, core;
+
+    if (cases == NULL)
+    {
+        file->unreadable = 1;
+        return;
+    }
+    for (i = 0; i < file->cases && !file->unimplemented; i++)
+    for (core = 0; core < CONFORMANCE_CORES; core++)
+    {
+        const struct conformance_case_t *test = &cases[i];
+        uint64_t cycles = emulator->cycles;
+        char report[sizeof(file->first_failure[0])];
+
+        emulator_inject_state(emulator, &test->initial.cpu);
+        for (j = 0; j < test->initial.ram_count; j++)
+            emulator->memory.blocks[test->initial.ram_addr[j]] = test->initial.ram_value[j];
+
+        conformance_step(emulator, core);
+        if (emulator->faulted)
+        {
+            // The whole opcode is missing, its other cases would fault too.
+            emulator->faulted = 0;
+            file->unimplemented = 1;
+            break;
+        }
+        if (conformance_check(emulator, test, (uint32_t) (emulator->cycles - cycles), report, sizeof(report)))
+            file->passed[core]++;
+        else if (file->first_failure[core][0] == '\0')
+            memcpy(file->first_failure[core], report, sizeof(report));
+
+        // Only the listed bytes are touched; clear them for the next case.
+        for (j = 0; j < test->initial.ram_count; j++) emulator->memory.blocks[test->initial.ram_addr[j]] = 0;
+        for (j = 0; j < test->final.ram_count; j++) emulator->memory.blocks[test->final.ram_addr[j]] = 0;
+    }
+    *run_ns += host_time_ns() - start;
+    free(cases);
+}
+
+static void *conformance_thread(void *arg)
+{
+    struct conformance_t *run = arg;
+    struct gameboy_emulator_t *emulator = malloc(sizeof(*emulator));
+    struct debugger_t *debugger = malloc(sizeof(*debugger));
+    uint64_t run_ns = 0;
+    int index;
+
+    // A flat bus: no boot ROM, and no I/O side effects behind traps.
+    // The debugger variants need a debugger, one without breakpoints.
+    emulator_initialize(emulator);
+    emulator->contain_faults = 1;
+    emulator->memory.boot_rom_mapped = 0;
+    memset(emulator->memory.blocks, 0, sizeof(emulator->memory.blocks));
+    debugger_attach(emulator, debugger);
+    memset(emulator->memory.page_traps, 0, sizeof(emulator->memory.page_traps));
+
+    while ((index = atomic_fetch_add(&run->next, 1)) < run->count)
+        conformance_run_file(emulator, &run->files[index], &run_ns);
+
+    atomic_fetch_add(&run->run_ns, run_ns);
+    free(debugger);
+    free(emulator);
+    return NULL;
+}
+
+static int compare_conformance_files(const void *a, const void *b)
+{
+    return (int) ((const struct conformance_file_t *) a)->opcode - (int) ((const struct conformance_file_t *) b)->opcode;
+}
+
+static int conformance_main(const char *directory, int threads)
+{
+    // Runs every *.json file in directory. Returns 1 if any case
+    // differs, unimplemented opcodes aside.
+    struct conformance_t run;
+    pthread_t workers[CONFORMANCE_MAX_THREADS];
+    uint64_t cases = 0, passed = 0, start;
+    int i, core, differ = 0, missing = 0;
+    struct dirent *entry;
+    DIR *dir = opendir(directory);
+
+    if (dir == NULL)
+    {
+        printf("[ERROR] Cannot open test directory %s.\n", directory);
+        return 1;
+    }
+    memset(&run, 0, sizeof(run));
+    run.files = calloc(CONFORMANCE_MAX_FILES, sizeof(*run.files));
+    while ((entry = readdir(dir)) != NULL && run.count < CONFORMANCE_MAX_FILES)
+    {
+        struct conformance_file_t *file = &run.files[run.count];
+        unsigned int opcode;
+        size_t length = strlen(entry->d_name);
+
+        if (length < 5 || strcmp(&entry->d_name[length - 5], ".json") != 0) continue;
+        if (sscanf(entry->d_name, "cb %x", &opcode) == 1 || sscanf(entry->d_name, "CB %x", &opcode) == 1) opcode |= 0x100;
+        else if (sscanf(entry->d_name, "%x", &opcode) != 1) continue;
+        file->opcode = opcode;
+        snprintf(file->path, sizeof(file->path), "%s/%s", directory, entry->d_name);
+        run.count++;
+    }
+    closedir(dir);
+    qsort(run.files, run.count, sizeof(*run.files), compare_conformance_files);
+
+    if (threads < 1) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > CONFORMANCE_MAX_THREADS) threads = CONFORMANCE_MAX_THREADS;
+    atomic_init(&run.next, 0);
+    atomic_init(&run.run_ns, 0);
+    start = host_time_ns();
+    for (i = 0; i < threads; i++) pthread_create(&workers[i], NULL, conformance_thread, &run);
+    for (i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+    start = host_time_ns() - start;
+
+    for (i = 0; i < run.count; i++)
+    {
+        struct conformance_file_t *file = &run.files[i];
+        const char *prefix = file->opcode & 0x100 ? "CB " : "";
+
+        if (file->unreadable)
+        {
+            printf("[ERROR] Cannot parse %s.\n", file->path);
+            differ++;
+            continue;
+        }
+        if (file->unimplemented)
+        {
+            missing++;
+            continue;
+        }
+        for (core = 0; core < CONFORMANCE_CORES; core++)
+        {
+            cases += file->cases;
+            passed += file->passed[core];
+            if (file->passed[core] == file->cases) continue;
+            printf("[ERROR] %s$%02x on %s: %u of %u cases differ, first %s\n", prefix, file->opcode & 0xff,
+                   conformance_cores[core], file->cases - file->passed[core], file->cases, file->first_failure[core]);
+        }
+        for (core = 0; core < CONFORMANCE_CORES; core++)
+            if (file->passed[core] != file->cases)
+            {
+                differ++;
+                break;
+            }
+    }
+    if (missing)
+    {
+        printf("[WARN ] %d opcodes not implemented:", missing);
+        for (i = 0; i < run.count; i++)
+            if (run.files[i].unimplemented) printf(" %s%02x", run.files[i].opcode & 0x100 ? "CB" : "", run.files[i].opcode & 0xff);
+        printf("\n");
+    }
+    printf("[INFO ] %d files on %d threads, %d core variants: %llu of %llu case runs passed, %d opcodes differ.\n",
+           run.count, threads, CONFORMANCE_CORES, (unsigned long long) passed, (unsigned long long) cases, differ);
+    if (start && run.run_ns)
+        printf("[INFO ] %.0f cases/s including parsing, %.0f cases/s per thread executing.\n",
+               cases * 1e9 / start, cases * 1e9 / run.run_ns);
+    free(run.files);
+    return differ ? 1 : 0;
+}
+#endif // GB_LIBRARY
+
+// Rollback netplay
+//
+// Both peers run the same machine. The joypad each frame is the OR of
+// the local and the remote player's buttons. A frame whose remote input
+// has not arrived yet runs on a prediction (the last remote input
+// known), so local input never waits on the network. Every frame
+// starts with a snapshot. When a remote input turns out to differ from
+// what was predicted, the machine is restored to the snapshot of that
+// frame and re-simulated up to the present, muted, within one call.
+//
+// Inputs travel over UDP. Each packet repeats every input the peer has
+// not acknowledged, so lost packets need no retransmission. A peer
+// stalls rather than run more than NETPLAY_WINDOW frames ahead of what
+// it knows. For loopback testing, sends can be delayed and dropped.
+#define NETPLAY_WINDOW          16
+#define NETPLAY_MAGIC           0x4e424701      // "GBN" + version
+// Remote inputs arrive up to a window ahead of the current frame.
+#define NETPLAY_REMOTE_RING     (NETPLAY_WINDOW * 2)
+#define NETPLAY_QUEUE           64
+#define NETPLAY_ADVANCED        0
+#define NETPLAY_STALLED         1
+
+struct netplay_packet_t {
+    uint32_t magic;
+    // Inputs of frames first .. first + count - 1.
+    uint32_t first;
+    uint32_t count;
+    // The sender has all of our inputs before this frame.
+    uint32_t ack;
+    uint8_t inputs[NETPLAY_WINDOW];
+};
+
+struct netplay_delayed_t {
+    uint64_t due;
+    struct netplay_packet_t packet;
+};
+
+struct netplay_t {
+    int socket;
+    struct sockaddr_in peer;
+    // Next frame to simulate, and the number of local inputs given.
+    uint32_t frame;
+    uint32_t local_next;
+    // First frame whose remote input is unknown.
+    uint32_t remote_next;
+    // First frame of ours the peer has not acknowledged.
+    uint32_t peer_ack;
+    // Earliest frame simulated on a wrong prediction, UINT32_MAX if none.
+    uint32_t rollback_to;
+    uint8_t local[NETPLAY_WINDOW];
+    uint8_t remote[NETPLAY_REMOTE_RING];
+    // Remote input each frame was simulated with.
+    uint8_t used[NETPLAY_WINDOW];
+    // Machine state at the start of each frame in the window.
+    struct gameboy_emulator_t *snapshots;
+    // Statistics.
+    uint64_t rollbacks;
+    uint64_t resimulated;
+    uint64_t resimulation_ns;
+    uint64_t stalls;
+    // Loopback simulator: one way latency, jitter and loss of sends.
+    uint32_t latency_ms;
+    uint32_t jitter_ms;
+    uint32_t loss_pct;
+    uint64_t random;
+    struct netplay_delayed_t queue[NETPLAY_QUEUE];
+    int queued;
+};
+
+int netplay_open(struct netplay_t *netplay, uint16_t port, const char *peer_host, uint16_t peer_port)
+{
+    struct sockaddr_in local;
+
+    memset(netplay, 0, sizeof(*netplay));
+    netplay->rollback_to = UINT32_MAX;
+    netplay->random = 0x2545f4914f6cdd1dull ^ port;
+    netplay->peer.sin_family = AF_INET;
+    netplay->peer.sin_port = htons(peer_port);
+    if (inet_pton(AF_INET, peer_host, &netplay->peer.sin_addr) != 1) return -1;
+
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((netplay->socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) return -1;
+    if (bind(netplay->socket, (struct sockaddr *) &local, sizeof(local)) != 0 ||
+        (netplay->snapshots = calloc(NETPLAY_WINDOW, sizeof(struct gameboy_emulator_t))) == NULL)
+    {
+        close(netplay->socket);
+        return -1;
+    }
+    return 0;
+}
+
+void netplay_close(struct netplay_t *netplay)
+{
+    close(netplay->socket);
+    free(netplay->snapshots);
+    netplay->snapshots = NULL;
+}
+
+void netplay_simulate_network(struct netplay_t *netplay, uint32_t latency_ms, uint32_t jitter_ms, uint32_t loss_pct)
+{
+    netplay->latency_ms = latency_ms;
+    netplay->jitter_ms = jitter_ms;
+    netplay->loss_pct = loss_pct;
+}
+
+static uint32_t netplay_random(struct netplay_t *netplay)
+{
+    // xorshift64*, seeded per port, so a simulated run is repeatable
+    // as far as the host scheduler allows.
+    netplay->random ^= netplay->random >> 12;
+    netplay->random ^= netplay->random << 25;
+    netplay->random ^= netplay->random >> 27;
+    return (netplay->random * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+static void netplay_flush(struct netplay_t *netplay)
+{
+    // Sends the delayed packets that are due, oldest first.
+    uint64_t now = host_time_ns();
+    int i, kept = 0;
+
+    for (i = 0; i < netplay->queued; i++)
+    {
+        if (netplay->queue[i].due <= now)
+            sendto(netplay->socket, &netplay->queue[i].packet, sizeof(netplay->queue[i].packet), 0,
+                   (struct sockaddr *) &netplay->peer, sizeof(netplay->peer));
+        else
+            netplay->queue[kept++] = netplay->queue[i];
+    }
+    netplay->queued = kept;
+}
+
+static void netplay_send(struct netplay_t *netplay)
+{
+    struct netplay_packet_t packet;
+    uint32_t frame;
+
+    packet.magic = NETPLAY_MAGIC;
+    packet.first = netplay->peer_ack;
+    packet.count = netplay->local_next - netplay->peer_ack;
+    packet.ack = netplay->remote_next;
+    for (frame = packet.first; frame < packet.first + packet.count; frame++)
+        packet.inputs[frame - packet.first] = netplay->local[frame % NETPLAY_WINDOW];
+
+    netplay_flush(netplay);
+    if (netplay->loss_pct && netplay_random(netplay) % 100 < netplay->loss_pct) return;
+    if (netplay->latency_ms || netplay->jitter_ms)
+    {
+        uint32_t delay = netplay->latency_ms + (netplay->jitter_ms ? netplay_random(netplay) % (netplay->jitter_ms + 1) : 0);
+        if (netplay->queued == NETPLAY_QUEUE) return;       // A full link drops.
+        netplay->queue[netplay->queued].due = host_time_ns() + delay * 1000000ull;
+        netplay->queue[netplay->queued].packet = packet;
+        netplay->queued++;
+        return;
+    }
+    sendto(netplay->socket, &packet, sizeof(packet), 0, (struct sockaddr *) &netplay->peer, sizeof(netplay->peer));
+}
+
+static void netplay_receive(struct netplay_t *netplay)
+{
+    struct netplay_packet_t packet;
+
+    while (recv(netplay->socket, &packet, sizeof(packet), MSG_DONTWAIT) == sizeof(packet))
+    {
+        uint32_t frame;
+
+        if (packet.magic != NETPLAY_MAGIC || packet.count > NETPLAY_WINDOW ||
+            packet.first + packet.count > netplay->frame + NETPLAY_REMOTE_RING) continue;
+        if (packet.ack > netplay->peer_ack && packet.ack <= netplay->local_next) netplay->peer_ack = packet.ack;
+        if (packet.first > netplay->remote_next) continue;      // A gap, wait for a resend.
+
+        for (frame = netplay->remote_next; frame < packet.first + packet.count; frame++)
+        {
+            uint8_t input = packet.inputs[frame - packet.first];
+
+            netplay->remote[frame % NETPLAY_REMOTE_RING] = input;
+            if (frame < netplay->frame && input != netplay->used[frame % NETPLAY_WINDOW] && frame < netplay->rollback_to)
+                netplay->rollback_to = frame;
+        }
+        if (packet.first + packet.count > netplay->remote_next) netplay->remote_next = packet.first + packet.count;
+    }
+}
+
+static void netplay_simulate(struct netplay_t *netplay, struct gameboy_emulator_t *emulator, uint32_t frame)
+{
+    uint8_t remote;
+
+    if (frame < netplay->remote_next) remote = netplay->remote[frame % NETPLAY_REMOTE_RING];
+    else remote = netplay->remote_next ? netplay->remote[(netplay->remote_next - 1) % NETPLAY_REMOTE_RING] : 0;
+
+    netplay->snapshots[frame % NETPLAY_WINDOW] = *emulator;
+    netplay->used[frame % NETPLAY_WINDOW] = remote;
+    joypad_press(emulator, netplay->local[frame % NETPLAY_WINDOW] | remote);
+    emulator_run_until_vblank(emulator);
+}
+
+static void netplay_rollback(struct netplay_t *netplay, struct gameboy_emulator_t *emulator)
+{
+    // Audio, video, hash log and metrics of the frames being redone
+    // have had them once already, so all of them are detached.
+    struct audio_output_t *output = emulator->apu.output;
+    struct frame_buffers_t *frames_out = emulator->ppu.frames_out;
+    struct hash_log_t *hash_log = emulator->hash_log;
+    struct metrics_t *metrics = emulator->metrics;
+    uint64_t start = host_time_ns();
+    uint32_t frame;
+
+    if (output) apu_attach_output(emulator, NULL, NULL, 0);
+    emulator->ppu.frames_out = NULL;
+    emulator->hash_log = NULL;
+    emulator->metrics = NULL;
+    emulator_copy_state(emulator, &netplay->snapshots[netplay->rollback_to % NETPLAY_WINDOW]);
+    for (frame = netplay->rollback_to; frame < netplay->frame; frame++) netplay_simulate(netplay, emulator, frame);
+    emulator->ppu.frames_out = frames_out;
+    emulator->hash_log = hash_log;
+    emulator->metrics = metrics;
+    if (output) apu_attach_output(emulator, output, output->ring, output->sample_rate);
+
+    netplay->rollbacks++;
+    netplay->resimulated += netplay->frame - netplay->rollback_to;
+    netplay->resimulation_ns += host_time_ns() - start;
+    netplay->rollback_to = UINT32_MAX;
+}
+
+int netplay_advance(struct netplay_t *netplay, struct gameboy_emulator_t *emulator, uint8_t buttons)
+{
+    // Runs one frame with the local JOYPAD_* buttons, once per host
+    // frame. Returns NETPLAY_STALLED, having run nothing, while the
+    // peer is too far behind; call again next host frame.
+    uint32_t oldest;
+
+    netplay_receive(netplay);
+    oldest = netplay->remote_next < netplay->peer_ack ? netplay->remote_next : netplay->peer_ack;
+    if (netplay->frame - oldest >= NETPLAY_WINDOW - 1)
+    {
+        netplay->stalls++;
+        netplay_send(netplay);
+        return NETPLAY_STALLED;
+    }
+
+    netplay->local[netplay->frame % NETPLAY_WINDOW] = buttons;
+    netplay->local_next = netplay->frame + 1;
+    netplay_send(netplay);
+    if (netplay->rollback_to < netplay->frame) netplay_rollback(netplay, emulator);
+    netplay_simulate(netplay, emulator, netplay->frame);
+    netplay->frame++;
+    return NETPLAY_ADVANCED;
+}
+
+#ifndef GB_LIBRARY
+static int rollback_benchmark_main(uint32_t frames)
+{
+    // Cost of one rollback on the frame_loop guest: restore a snapshot
+    // and re-simulate frames frames, taking a snapshot before each.
+    static struct gameboy_emulator_t emulator;
+    static struct gameboy_emulator_t snapshots[NETPLAY_WINDOW];
+    uint64_t samples[BENCHMARK_SAMPLES];
+    uint64_t start, save_ns, restore_ns;
+    double frame_ms = 1000.0 * CLOCKS_PER_LINE * LINES_PER_FRAME / CPU_CLOCK;
+    double median_ms;
+    uint32_t frame;
+    int i;
+
+    if (frames == 0 || frames >= NETPLAY_WINDOW) frames = NETPLAY_WINDOW - 1;
+    benchmark_load_frame_loop(&emulator);
+    emulator_run_until_vblank(&emulator);
+
+    start = host_time_ns();
+    for (i = 0; i < 1000; i++) snapshots[i % NETPLAY_WINDOW] = emulator;
+    save_ns = (host_time_ns() - start) / 1000;
+    start = host_time_ns();
+    for (i = 0; i < 1000; i++) emulator_copy_state(&emulator, &snapshots[0]);
+    restore_ns = (host_time_ns() - start) / 1000;
+
+    for (i = -1; i < BENCHMARK_SAMPLES; i++)
+    {
+        start = host_time_ns();
+        emulator_copy_state(&emulator, &snapshots[0]);
+        for (frame = 0; frame < frames; frame++)
+        {
+            snapshots[(frame + 1) % NETPLAY_WINDOW] = emulator;
+            emulator_run_until_vblank(&emulator);
+        }
+        if (i >= 0) samples[i] = host_time_ns() - start;     // The first run warms up.
+    }
+    qsort(samples, BENCHMARK_SAMPLES, sizeof(samples[0]), compare_u64);
+    median_ms = samples[BENCHMARK_SAMPLES / 2] / 1e6;
+
+    printf("[INFO ] Snapshot of %zu bytes: save %.2f us, restore %.2f us\n",
+           sizeof(emulator), save_ns / 1e3, restore_ns / 1e3);
+    printf("[INFO ] Rollback of %u frames: %.3f ms median (%.3f to %.3f ms), %.1fx real time, %.0f%% of a frame\n",
+           frames, median_ms, samples[0] / 1e6, samples[BENCHMARK_SAMPLES - 1] / 1e6,
+           frames * frame_ms / median_ms, median_ms * 100.0 / frame_ms);
+    return median_ms < frame_ms ? 0 : 1;
+}
+#endif // GB_LIBRARY
+
+// Real-time pacing
+//
+// An interactive machine runs a whole frame as one burst, as fast as
+// the host can, then sleeps on an absolute CLOCK_MONOTONIC deadline
+// until the frame is due. Deadlines are a multiple of the frame period
+// from the start rather than from the previous wake-up, so sleep
+// overshoot does not add up. Host timer slack is lowered so wake-ups
+// are not rounded to 50 us.
+//
+// Audio is made at the emulated clock and played at the sound card's,
+// which drifts from the host clock. With a ring attached the period is
+// stretched or shrunk by up to PACER_MAX_SKEW to keep the ring filled
+// to its target: a ring filling up means the machine is ahead of the
+// sound card. A consumer that drains faster than real time, like a
+// file, just runs at the upper end of the correction.
+//
+// This core has no HALT, so a guest waiting for VBlank still spins
+// through its loop, but only for the burst: a machine at 60 fps costs
+// the host about 0.1 ms a frame.
+#define PACER_FRAME_NS          (1e9 * CLOCKS_PER_LINE * LINES_PER_FRAME / CPU_CLOCK)
+#define PACER_MAX_SKEW          0.005
+#define PACER_MAX_LAG_FRAMES    4       // Behind by more, the deadlines restart from now.
+#define PACER_AUDIO_TARGET      2400    // 50 ms at 48 kHz.
+
+struct pacer_t {
+    uint64_t deadline_ns;           // When the next frame is due.
+    double remainder_ns;            // Fraction of a nanosecond carried between periods.
+    double skew;                    // Period correction currently applied.
+    struct audio_ring_t *ring;      // NULL runs without drift correction.
+    uint32_t ring_target;           // Frames of audio the ring should hold.
+    uint64_t frames;
+    uint64_t resyncs;               // Times the host fell behind and skipped ahead.
+};
+
+void pacer_start(struct pacer_t *pacer, struct audio_ring_t *ring, uint32_t ring_target)
+{
+    // The first frame is due at once.
+    memset(pacer, 0, sizeof(*pacer));
+    pacer->ring = ring;
+    pacer->ring_target = ring_target ? ring_target : 1;
+    pacer->deadline_ns = host_time_ns();
+#ifdef PR_SET_TIMERSLACK
+    prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+#endif
+}
+
+void pacer_advance(struct pacer_t *pacer)
+{
+    // Moves the deadline past the frame just run.
+    double period = PACER_FRAME_NS;
+    uint64_t now = host_time_ns();
+
+    if (pacer->ring)
+    {
+        double error = ((double) audio_ring_available(pacer->ring) - pacer->ring_target) / pacer->ring_target;
+
+        if (error > 1.0) error = 1.0;
+        if (error < -1.0) error = -1.0;
+        // Filtered, since the fill level jumps with every write.
+        pacer->skew += (error * PACER_MAX_SKEW - pacer->skew) / 16.0;
+        period *= 1.0 + pacer->skew;
+    }
+    period += pacer->remainder_ns;
+    pacer->deadline_ns += (uint64_t) period;
+    pacer->remainder_ns = period - (uint64_t) period;
+    pacer->frames++;
+
+    if (now > pacer->deadline_ns + (uint64_t) (PACER_MAX_LAG_FRAMES * PACER_FRAME_NS))
+    {
+        pacer->deadline_ns = now;
+        pacer->resyncs++;
+    }
+}
+
+void pacer_wait(struct pacer_t *pacer)
+{
+    struct timespec deadline;
+
+    deadline.tv_sec = pacer->deadline_ns / 1000000000ull;
+    deadline.tv_nsec = pacer->deadline_ns % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {}
+}
+
+#ifndef GB_LIBRARY
+// Session server
+//
+// Hosts many machines in one process, one session per connection on a
+// Unix or TCP socket. A poll loop on the main thread watches the idle
+// sessions. When a client sends something, its session is queued for a
+// fixed pool of workers, and a worker runs the session's commands and
+// replies. A session no client is talking to sits in poll() and costs
+// no CPU. Long runs are cut into slices of SERVER_SLICE_FRAMES and
+// requeued behind the other ready sessions.
+//
+// A session switched to SERVER_PACE runs in real time instead: the
+// poll loop sleeps until the earliest frame due, and a paced session
+// is only queued when a frame of it is due or its client sent
+// something. Commands are carried out between the frames of a paced
+// run, so input changes take effect at the next frame, with their
+// SERVER_OK interleaved with the frames.
+//
+// Messages in both directions are a server_message_t and length bytes
+// of payload, in the host's byte order. Frames are sent as deltas of
+// palette indices (shades 0-3, or palette RAM indices 0-63 in CGB
+// mode) against the previous frame sent, which starts out all zeroes:
+// spans of a 16 bit count of unchanged pixels to skip, a 16 bit count
+// of pixels that follow, and those pixels.
+#define SERVER_LOAD_ROM         0x01    // Payload: ROM image. Arg: BOOT_FULL or BOOT_SKIP.
+#define SERVER_INPUT            0x02    // Arg: JOYPAD_* buttons held.
+#define SERVER_RUN              0x03    // Arg: frames. One SERVER_FRAME per frame.
+#define SERVER_SAVE_STATE       0x04    // Replied with SERVER_STATE.
+#define SERVER_LOAD_STATE       0x05    // Payload: a SERVER_STATE payload.
+#define SERVER_PACE             0x06    // Arg: 1 runs in real time, 0 as fast as possible.
+#define SERVER_OK               0x80
+#define SERVER_ERROR            0x81    // Payload: message text.
+#define SERVER_FRAME            0x82    // Arg: frame number. Payload: delta.
+#define SERVER_STATE            0x83    // Payload: state header and state.
+
+#define SERVER_MAX_WORKERS      64
+#define SERVER_SLICE_FRAMES     4
+#define SERVER_DELTA_GAP        4
+#define SERVER_MAX_PAYLOAD      (sizeof(struct state_header_t) + sizeof(struct gameboy_emulator_t))
+
+struct server_message_t {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t arg;
+    uint32_t length;
+};
+
+struct session_t {
+    struct gameboy_emulator_t emulator;
+    uint8_t framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+    uint8_t previous[SCREEN_WIDTH * SCREEN_HEIGHT];
+    uint8_t delta[SCREEN_WIDTH * SCREEN_HEIGHT * 2];
+    uint8_t payload[SERVER_MAX_PAYLOAD];
+    int socket;
+    uint8_t loaded;
+    // Exported counters, if the shared memory object could be made.
+    struct metrics_t metrics;
+    // Frames left of the current SERVER_RUN.
+    uint32_t frames_left;
+    uint8_t paced;
+    struct pacer_t pacer;
+    // Queued for or owned by a worker; the poll loop skips it.
+    uint8_t busy;
+    struct session_t *next;
+    struct session_t *next_ready;
+};
+
+struct server_t {
+    int listener;
+    // Workers write a byte here to have the poll loop rescan.
+    int wake[2];
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct session_t *sessions;
+    struct session_t *ready_head;
+    struct session_t *ready_tail;
+    uint32_t session_count;
+    pthread_t workers[SERVER_MAX_WORKERS];
+    int worker_count;
+};
+
+static int server_read(int socket, void *data, size_t size)
+{
+    uint8_t *bytes = data;
+
+    while (size)
+    {
+        ssize_t count = recv(socket, bytes, size, 0);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return -1;
+        bytes += count;
+        size -= count;
+    }
+    return 0;
+}
+
+static int server_write(int socket, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+
+    while (size)
+    {
+        ssize_t count = send(socket, bytes, size, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return -1;
+        bytes += count;
+        size -= count;
+    }
+    return 0;
+}
+
+static int session_reply(struct session_t *session, uint8_t type, uint32_t arg, const void *payload, uint32_t length)
+{
+    struct server_message_t message = { type, { 0, 0, 0 }, arg, length };
+
+    if (server_write(session->socket, &message, sizeof(message)) != 0) return -1;
+    return length ? server_write(session->socket, payload, length) : 0;
+}
+
+static int session_error(struct session_t *session, const char *text)
+{
+    return session_reply(session, SERVER_ERROR, 0, text, strlen(text));
+}
+
+static uint32_t session_encode_delta(struct session_t *session)
+{
+    // Changes closer than SERVER_DELTA_GAP share a span, since a span
+    // header costs as much as four pixels.
+    const uint8_t *frame = session->framebuffer;
+    uint8_t *previous = session->previous;
+    uint32_t size = 0, end = 0, i = 0;
+
+    while (i < SCREEN_WIDTH * SCREEN_HEIGHT)
+    {
+        uint32_t start, last, j;
+        uint16_t skip, length;
+
+        if (frame[i] == previous[i])
+        {
+            i++;
+            continue;
+        }
+        start = last = i;
+        for (j = i + 1; j < SCREEN_WIDTH * SCREEN_HEIGHT && j - last <= SERVER_DELTA_GAP; j++)
+            if (frame[j] != previous[j]) last = j;
+
+        skip = start - end;
+        length = last + 1 - start;
+        memcpy(&session->delta[size], &skip, 2);
+        memcpy(&session->delta[size + 2], &length, 2);
+        memcpy(&session->delta[size + 4], &frame[start], length);
+        memcpy(&previous[start], &frame[start], length);
+        size += 4 + length;
+        end = i = last + 1;
+    }
+    return size;
+}
+
+static void session_reset(struct session_t *session)
+{
+    emulator_initialize(&session->emulator);
+    session->emulator.contain_faults = 1;
+    session->emulator.ppu.framebuffer = session->framebuffer;
+    if (session->metrics.shared) metrics_attach(&session->emulator, &session->metrics);
+    memset(session->previous, 0, sizeof(session->previous));
+    session->loaded = 0;
+    session->frames_left = 0;
+    session->paced = 0;
+}
+
+static int session_run_slice(struct session_t *session)
+{
+    struct gameboy_emulator_t *emulator = &session->emulator;
+    uint32_t frames = session->frames_left < SERVER_SLICE_FRAMES ? session->frames_left : SERVER_SLICE_FRAMES;
+
+    while (frames--)
+    {
+        if (session->paced && host_time_ns() < session->pacer.deadline_ns) break;
+        session->frames_left--;
+        emulator_run_until_vblank(emulator);
+        if (session->paced) pacer_advance(&session->pacer);
+        if (emulator->faulted)
+        {
+            printf("[WARN ] Session faulted on instruction $%x.\n", emulator->opcode);
+            dum_cpu_registers(emulator);
+            session->frames_left = 0;
+            return session_error(session, "Guest executed an unimplemented instruction.");
+        }
+        if (session_reply(session, SERVER_FRAME, (uint32_t) emulator->ppu.frames,
+                          session->delta, session_encode_delta(session)) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int session_command(struct session_t *session)
+{
+    // Reads and carries out one command. Returns -1 to drop the session.
+    struct gameboy_emulator_t *emulator = &session->emulator;
+    struct server_message_t message;
+    struct state_header_t header;
+
+    if (server_read(session->socket, &message, sizeof(message)) != 0) return -1;
+    if (message.length > SERVER_MAX_PAYLOAD) return -1;
+    if (server_read(session->socket, session->payload, message.length) != 0) return -1;
+
+    switch (message.type)
+    {
+        case SERVER_LOAD_ROM:
+            if (message.arg != BOOT_FULL && message.arg != BOOT_SKIP) return session_error(session, "Unknown boot mode.");
+            session_reset(session);
+            emulator_load_rom_data(emulator, session->payload, message.length);
+            if (emulator_boot(emulator, message.arg, NULL) != 0) return session_error(session, "Boot failed.");
+            if (emulator->metrics) metrics_attach(emulator, emulator->metrics);
+            session->loaded = 1;
+            return session_reply(session, SERVER_OK, 0, NULL, 0);
+        case SERVER_INPUT:
+            emulator_set_buttons(emulator, message.arg);
+            return session_reply(session, SERVER_OK, 0, NULL, 0);
+        case SERVER_RUN:
+            if (!session->loaded) return session_error(session, "No ROM loaded.");
+            if (session->paced && !session->frames_left) pacer_start(&session->pacer, NULL, 0);
+            session->frames_left = message.arg;
+            return 0;
+        case SERVER_PACE:
+            if (message.arg && !session->paced) pacer_start(&session->pacer, NULL, 0);
+            session->paced = message.arg != 0;
+            return session_reply(session, SERVER_OK, 0, NULL, 0);
+        case SERVER_SAVE_STATE:
+            header.magic = STATE_MAGIC;
+            header.version = STATE_VERSION;
+            header.size = sizeof(*emulator);
+            memcpy(session->payload, &header, sizeof(header));
+            memcpy(&session->payload[sizeof(header)], emulator, sizeof(*emulator));
+            return session_reply(session, SERVER_STATE, 0, session->payload, SERVER_MAX_PAYLOAD);
+        case SERVER_LOAD_STATE:
+            memcpy(&header, session->payload, sizeof(header));
+            if (message.length != SERVER_MAX_PAYLOAD || header.magic != STATE_MAGIC ||
+                header.version != STATE_VERSION || header.size != sizeof(*emulator))
+                return session_error(session, "Not a state of this build.");
+            if (!emulator_state_valid((const struct gameboy_emulator_t *) &session->payload[sizeof(header)]))
+                return session_error(session, "State is out of range.");
+            emulator_copy_state(emulator, (const struct gameboy_emulator_t *) &session->payload[sizeof(header)]);
+            session->loaded = 1;
+            return session_reply(session, SERVER_OK, 0, NULL, 0);
+        default:
+            return session_error(session, "Unknown command.");
+    }
+}
+
+static void server_enqueue(struct server_t *server, struct session_t *session)
+{
+    // Call with the lock held.
+    session->busy = 1;
+    session->next_ready = NULL;
+    if (server->ready_tail) server->ready_tail->next_ready = session;
+    else server->ready_head = session;
+    server->ready_tail = session;
+    pthread_cond_signal(&server->ready);
+}
+
+static void server_close_session(struct server_t *server, struct session_t *session)
+{
+    struct session_t **link;
+
+    pthread_mutex_lock(&server->lock);
+    for (link = &server->sessions; *link; link = &(*link)->next)
+    {
+        if (*link != session) continue;
+        *link = session->next;
+        break;
+    }
+    server->session_count--;
+    pthread_mutex_unlock(&server->lock);
+    close(session->socket);
+    metrics_close(&session->metrics);
+    free(session);
+}
+
+static void *server_worker(void *arg)
+{
+    struct server_t *server = arg;
+
+    for (;;)
+    {
+        struct session_t *session;
+        uint8_t byte;
+        int result, requeue;
+
+        pthread_mutex_lock(&server->lock);
+        while (server->ready_head == NULL) pthread_cond_wait(&server->ready, &server->lock);
+        session = server->ready_head;
+        server->ready_head = session->next_ready;
+        if (server->ready_head == NULL) server->ready_tail = NULL;
+        pthread_mutex_unlock(&server->lock);
+
+        // Commands that arrive during a run wait for it to finish,
+        // unless the run is paced.
+        result = 0;
+        if (session->frames_left && session->paced)
+        {
+            while (result == 0 && recv(session->socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 1)
+                result = session_command(session);
+            if (result == 0 && session->frames_left) result = session_run_slice(session);
+        }
+        else if (session->frames_left) result = session_run_slice(session);
+        else result = session_command(session);
+        while (result == 0 && !session->frames_left &&
+               recv(session->socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 1)
+            result = session_command(session);
+
+        if (result != 0)
+        {
+            server_close_session(server, session);
+            continue;
+        }
+        pthread_mutex_lock(&server->lock);
+        requeue = session->frames_left != 0 && !session->paced;
+        if (requeue) server_enqueue(server, session);
+        else session->busy = 0;
+        pthread_mutex_unlock(&server->lock);
+        if (!requeue) (void) !write(server->wake[1], "", 1);
+    }
+    return NULL;
+}
+
+static int server_listen(const char *address)
+{
+    // HOST:PORT listens on TCP, anything else is a Unix socket path.
+    const char *colon = strrchr(address, ':');
+    int fd;
+
+    if (colon)
+    {
+        struct sockaddr_in addr;
+        char host[64];
+        int on = 1;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(colon + 1));
+        snprintf(host, sizeof(host), "%.*s", (int) (colon - address), address);
+        if (inet_pton(AF_INET, host[0] ? host : "127.0.0.1", &addr.sin_addr) != 1) return -1;
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 && listen(fd, 64) == 0) return fd;
+    }
+    else
+    {
+        struct sockaddr_un addr;
+
+        if (strlen(address) >= sizeof(addr.sun_path)) return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, address);
+        unlink(address);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 && listen(fd, 64) == 0) return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+static int server_main(const char *address, int workers)
+{
+    static struct server_t server;
+    struct pollfd *fds = NULL;
+    struct session_t **owners = NULL;
+    uint32_t capacity = 0;
+    int i;
+
+    if (workers < 1) workers = 1;
+    if (workers > SERVER_MAX_WORKERS) workers = SERVER_MAX_WORKERS;
+    if ((server.listener = server_listen(address)) < 0 || pipe(server.wake) != 0)
+    {
+        printf("[ERROR] Cannot listen on %s.\n", address);
+        return 1;
+    }
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+    for (i = 0; i < workers; i++) pthread_create(&server.workers[i], NULL, server_worker, &server);
+    server.worker_count = workers;
+    printf("[INFO ] Serving sessions on %s with %d workers.\n", address, workers);
+    fflush(stdout);
+
+    for (;;)
+    {
+        struct session_t *session;
+        uint32_t count = 2, n;
+        uint64_t now = host_time_ns(), next_due = UINT64_MAX;
+        int timeout = -1;
+
+        pthread_mutex_lock(&server.lock);
+        if (capacity < server.session_count + 2)
+        {
+            capacity = (server.session_count + 2) * 2;
+            fds = realloc(fds, capacity * sizeof(*fds));
+            owners = realloc(owners, capacity * sizeof(*owners));
+        }
+        fds[0].fd = server.listener;
+        fds[1].fd = server.wake[0];
+        for (session = server.sessions; session; session = session->next)
+        {
+            if (session->busy) continue;
+            if (session->paced && session->frames_left)
+            {
+                if (session->pacer.deadline_ns <= now)
+                {
+                    server_enqueue(&server, session);
+                    continue;
+                }
+                if (session->pacer.deadline_ns < next_due) next_due = session->pacer.deadline_ns;
+            }
+            fds[count].fd = session->socket;
+            owners[count++] = session;
+        }
+        pthread_mutex_unlock(&server.lock);
+        for (n = 0; n < count; n++) fds[n].events = POLLIN;
+        // Rounded up to the millisecond, so frames are never early.
+        if (next_due != UINT64_MAX) timeout = (int) ((next_due - now + 999999) / 1000000);
+
+        if (poll(fds, count, timeout) < 0)
+        {
+            if (errno == EINTR) continue;
+            printf("[ERROR] poll failed.\n");
+            return 1;
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            char drain[64];
+            (void) !read(server.wake[0], drain, sizeof(drain));
+        }
+        pthread_mutex_lock(&server.lock);
+        for (n = 2; n < count; n++)
+            if (fds[n].revents) server_enqueue(&server, owners[n]);
+        pthread_mutex_unlock(&server.lock);
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(server.listener, NULL, NULL);
+            int on = 1;
+
+            if (fd < 0) continue;
+            if ((session = malloc(sizeof(*session))) == NULL)
+            {
+                close(fd);
+                continue;
+            }
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            session->socket = fd;
+            session->busy = 0;
+            if (metrics_open(&session->metrics) != 0) printf("[WARN ] Cannot export session metrics.\n");
+            session_reset(session);
+            pthread_mutex_lock(&server.lock);
+            session->next = server.sessions;
+            server.sessions = session;
+            server.session_count++;
+            pthread_mutex_unlock(&server.lock);
+        }
+    }
+}
+#endif // GB_LIBRARY
+
+// Audio writer
+//
+// Drains an audio ring on its own thread into a raw PCM file
+// (signed 16 bit, stereo, native endian), e.g. for an encoder.
+struct audio_writer_t {
+    struct audio_ring_t *ring;
+    FILE *file;
+    pthread_t thread;
+    _Atomic int stop;
+};
+
+static void *audio_writer_thread(void *arg)
+{
+    struct audio_writer_t *writer = arg;
+    int16_t frames[1024 * 2];
+
+    for (;;)
+    {
+        uint32_t count = audio_ring_available(writer->ring);
+        if (count == 0)
+        {
+            struct timespec pause = { 0, 1000000 };
+            if (atomic_load(&writer->stop)) break;
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        count = audio_ring_read(writer->ring, frames, count < 1024 ? count : 1024);
+        fwrite(frames, sizeof(int16_t) * 2, count, writer->file);
+    }
+    return NULL;
+}
+
+int audio_writer_start(struct audio_writer_t *writer, struct audio_ring_t *ring, const char *path)
+{
+    if ((writer->file = fopen(path, "wb")) == NULL) return -1;
+    writer->ring = ring;
+    atomic_init(&writer->stop, 0);
+    return pthread_create(&writer->thread, NULL, audio_writer_thread, writer);
+}
+
+void audio_writer_stop(struct audio_writer_t *writer)
+{
+    atomic_store(&writer->stop, 1);
+    pthread_join(writer->thread, NULL);
+    fclose(writer->file);
+}
+
+// Video writer
+//
+// Consumer of the frame buffers for headless runs: writes every frame
+// it gets as raw 8 bit grayscale, 160x144, to a file or pipe, e.g.
+// $ ffmpeg -f rawvideo -pix_fmt gray -s 160x144 -r 59.73 -i video.raw out.mp4
+// Frames published while it is busy writing are skipped, never queued.
+struct video_writer_t {
+    struct frame_buffers_t *buffers;
+    FILE *file;
+    pthread_t thread;
+    uint64_t written;
+    _Atomic int stop;
+};
+
+static void *video_writer_thread(void *arg)
+{
+    static const uint8_t shades[4] = { 0xff, 0xaa, 0x55, 0x00 };
+    struct video_writer_t *writer = arg;
+    uint8_t gray[SCREEN_WIDTH * SCREEN_HEIGHT];
+
+    for (;;)
+    {
+        const uint8_t *frame = frame_buffers_acquire(writer->buffers);
+        const uint16_t *colors;
+        uint8_t luma[64];
+        int i;
+
+        if (frame == NULL)
+        {
+            struct timespec pause = { 0, 1000000 };
+            if (atomic_load(&writer->stop)) break;
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        colors = frame_buffers_colors(writer->buffers);
+        if (colors)
+        {
+            // CGB frames: BT.601 luma of each palette RAM color.
+            for (i = 0; i < 64; i++)
+            {
+                uint8_t rgb[3];
+                frame_color_rgb(colors[i], rgb);
+                luma[i] = (77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2]) >> 8;
+            }
+            for (i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) gray[i] = luma[frame[i] & 0x3f];
+        }
+        else
+        {
+            for (i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) gray[i] = shades[frame[i]];
+        }
+        fwrite(gray, sizeof(gray), 1, writer->file);
+        writer->written++;
+    }
+    return NULL;
+}
+
+int video_writer_start(struct video_writer_t *writer, struct frame_buffers_t *buffers, const char *path)
+{
+    if ((writer->file = fopen(path, "wb")) == NULL) return -1;
+    writer->buffers = buffers;
+    writer->written = 0;
+    atomic_init(&writer->stop, 0);
+    return pthread_create(&writer->thread, NULL, video_writer_thread, writer);
+}
+
+void video_writer_stop(struct video_writer_t *writer)
+{
+    // Writes the last published frame, if still pending, before exiting.
+    atomic_store(&writer->stop, 1);
+    pthread_join(writer->thread, NULL);
+    fclose(writer->file);
+}
+
+// Post-processing
+//
+// Upscales finished frames and converts them for encoders, on threads
+// of its own, so none of this runs on the emulation thread. Each
+// worker takes the newest frame from the frame buffers, copies its
+// palette indices out (23 KB, which frees the slot at once) and
+// processes it in batches of rows. Workers handle different frames in
+// parallel, and frames are delivered in the order they were taken.
+//
+// Filters work on palette indices: Scale2x and Scale3x only compare
+// pixels, and the LCD grid marks its lines with a grid bit that
+// selects a darkened copy of the palette. The output conversion is
+// then a lookup per pixel, done by AVX2 or SSE2 kernels when the host
+// has them, and a scalar loop otherwise. CGB frames bring 64 colors of
+// their own, more than the vector lookups hold, and take the scalar
+// loop.
+// For more details: https://www.scale2x.it/algorithm
+#define POSTPROCESS_NEAREST         0
+#define POSTPROCESS_SCALE2X         1
+#define POSTPROCESS_SCALE3X         2
+#define POSTPROCESS_LCD_GRID        3
+
+#define POSTPROCESS_GRAY            0       // 8 bit luma, 1 byte per pixel
+#define POSTPROCESS_RGBA            1       // R, G, B, A bytes
+#define POSTPROCESS_I420            2       // Y plane, then U and V at half resolution
+
+#define POSTPROCESS_KERNEL_AUTO     0
+#define POSTPROCESS_KERNEL_SCALAR   1
+#define POSTPROCESS_KERNEL_SSE2     2
+#define POSTPROCESS_KERNEL_AVX2     3
+
+#define POSTPROCESS_MAX_SCALE       8
+#define POSTPROCESS_MAX_THREADS     16
+#define POSTPROCESS_BATCH_ROWS      8
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POSTPROCESS_X86
+#endif
+
+struct postprocess_palette_t {
+    // Colors of every index, as RGBA bytes and as BT.601 YUV.
+    uint8_t rgba[128][4];
+    uint8_t luma[128];
+    uint8_t chroma_u[128];
+    uint8_t chroma_v[128];
+    // Indices in use, and the LCD grid bit: 4 shades and bit 2 for DMG
+    // frames, 64 colors and bit 6 for CGB frames.
+    int entries;
+    uint8_t grid;
+};
+
+struct postprocess_t {
+    struct frame_buffers_t *buffers;
+    uint8_t filter;
+    uint8_t format;
+    uint8_t kernel;
+    uint32_t scale;
+    uint32_t width;
+    uint32_t height;
+    size_t output_size;
+    // Palette of DMG frames.
+    struct postprocess_palette_t palette;
+    // Called in frame order, from a worker thread.
+    void (*deliver)(const uint8_t *image, size_t size, void *context);
+    void *context;
+    pthread_t threads[POSTPROCESS_MAX_THREADS];
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    uint64_t taken;
+    uint64_t delivered;
+    _Atomic int stop;
+};
+
+static void postprocess_rgba_scalar(const uint8_t *indices, uint8_t *out, size_t count, const uint8_t (*rgba)[4], int entries)
+{
+    size_t i;
+    for (i = 0; i < count; i++) memcpy(&out[i * 4], rgba[indices[i]], 4);
+}
+
+static void postprocess_luma_scalar(const uint8_t *indices, uint8_t *out, size_t count, const uint8_t *luma, int entries)
+{
+    size_t i;
+    for (i = 0; i < count; i++) out[i] = luma[indices[i]];
+}
+
+#ifdef POSTPROCESS_X86
+static void postprocess_luma_sse2(const uint8_t *indices, uint8_t *out, size_t count, const uint8_t *luma, int entries)
+{
+    // No byte shuffle in SSE2: select each color by compare. Colors 4-7
+    // only occur with the LCD grid, so without it 4 compares do. There
+    // is no RGBA variant; at 4 bytes a pixel the table copy is faster.
+    size_t i;
+    int k;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        __m128i index = _mm_loadu_si128((const __m128i *) &indices[i]);
+        __m128i result = _mm_setzero_si128();
+        for (k = 0; k < entries; k++)
+            result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi8(index, _mm_set1_epi8(k)), _mm_set1_epi8(luma[k])));
+        _mm_storeu_si128((__m128i *) &out[i], result);
+    }
+    postprocess_luma_scalar(&indices[i], &out[i], count - i, luma, entries);
+}
+
+__attribute__((target("avx2")))
+static void postprocess_rgba_avx2(const uint8_t *indices, uint8_t *out, size_t count, const uint8_t (*rgba)[4], int entries)
+{
+    // One 8 entry lane permute per 8 pixels.
+    __m256i palette = _mm256_loadu_si256((const __m256i *) rgba);
+    size_t i;
+
+    for (i = 0; i + 8 <= count; i += 8)
+    {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) &indices[i]));
+        _mm256_storeu_si256((__m256i *) &out[i * 4], _mm256_permutevar8x32_epi32(palette, index));
+    }
+    postprocess_rgba_scalar(&indices[i], &out[i * 4], count - i, rgba, entries);
+}
+
+__attribute__((target("avx2")))
+static void postprocess_luma_avx2(const uint8_t *indices, uint8_t *out, size_t count, const uint8_t *luma, int entries)
+{
+    // Indices are below 16, so a byte shuffle is a table lookup.
+    uint8_t table[16] = { 0 };
+    __m256i lookup;
+    size_t i;
+
+    memcpy(table, luma, 8);
+    lookup = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) table));
+    for (i = 0; i + 32 <= count; i += 32)
+    {
+        __m256i index = _mm256_loadu_si256((const __m256i *) &indices[i]);
+        _mm256_storeu_si256((__m256i *) &out[i], _mm256_shuffle_epi8(lookup, index));
+    }
+    postprocess_luma_scalar(&indices[i], &out[i], count - i, luma, entries);
+}
+#endif
+
+static void postprocess_widen(const uint8_t *row, uint8_t *out, uint32_t scale, uint8_t kernel)
+{
+    // Repeats every pixel of a source row scale times. Power of two
+    // scales interleave a vector with itself once per doubling.
+    uint32_t x;
+
+#ifdef POSTPROCESS_X86
+    if (kernel != POSTPROCESS_KERNEL_SCALAR && (scale == 2 || scale == 4 || scale == 8))
+    {
+        for (x = 0; x < SCREEN_WIDTH; x += 16)
+        {
+            __m128i pixels[8];
+            uint32_t count = 1, n, width;
+
+            pixels[0] = _mm_loadu_si128((const __m128i *) &row[x]);
+            for (width = 1; width < scale; width *= 2)
+            {
+                for (n = count; n-- > 0; )
+                {
+                    pixels[n * 2 + 1] = _mm_unpackhi_epi8(pixels[n], pixels[n]);
+                    pixels[n * 2] = _mm_unpacklo_epi8(pixels[n], pixels[n]);
+                }
+                count *= 2;
+            }
+            for (n = 0; n < count; n++) _mm_storeu_si128((__m128i *) &out[x * scale + n * 16], pixels[n]);
+        }
+        return;
+    }
+#endif
+    for (x = 0; x < SCREEN_WIDTH; x++) memset(&out[x * scale], row[x], scale);
+}
+
+static void postprocess_scale_rows(const struct postprocess_t *post, const struct postprocess_palette_t *palette,
+                                   const uint8_t *frame, uint8_t *scaled, uint32_t first, uint32_t last)
+{
+    // Scales source rows first..last-1 into scaled, in palette indices.
+    uint32_t s = post->scale;
+    uint32_t width = post->width;
+    uint32_t x, y, j;
+
+    if (post->filter == POSTPROCESS_NEAREST || post->filter == POSTPROCESS_LCD_GRID)
+    {
+        // One widened row per source row, copied down the cell. The LCD
+        // grid darkens the last column and row of every cell.
+        uint8_t grid = post->filter == POSTPROCESS_LCD_GRID && s > 1 ? palette->grid : 0;
+
+        for (y = first; y < last; y++)
+        {
+            uint8_t *out = &scaled[y * s * width];
+
+            postprocess_widen(&frame[y * SCREEN_WIDTH], out, s, post->kernel);
+            if (grid)
+                for (x = s - 1; x < width; x += s) out[x] |= grid;
+            for (j = 1; j < s; j++) memcpy(&out[j * width], out, width);
+            if (grid)
+                for (x = 0; x < width; x++) out[(s - 1) * width + x] |= grid;
+        }
+        return;
+    }
+
+    for (y = first; y < last; y++)
+    {
+        const uint8_t *row = &frame[y * SCREEN_WIDTH];
+        const uint8_t *above = y > 0 ? row - SCREEN_WIDTH : row;
+        const uint8_t *below = y < SCREEN_HEIGHT - 1 ? row + SCREEN_WIDTH : row;
+        uint8_t *out = &scaled[y * s * width];
+
+        for (x = 0; x < SCREEN_WIDTH; x++)
+        {
+            uint32_t l = x > 0 ? x - 1 : x;
+            uint32_t r = x < SCREEN_WIDTH - 1 ? x + 1 : x;
+            uint8_t e = row[x];
+
+            if (post->filter == POSTPROCESS_SCALE2X)
+            {
+                uint8_t a = above[x], b = row[r], c = row[l], d = below[x];
+                out[x * 2]             = c == a && c != d && a != b ? a : e;
+                out[x * 2 + 1]         = a == b && a != c && b != d ? b : e;
+                out[width + x * 2]     = d == c && d != b && c != a ? c : e;
+                out[width + x * 2 + 1] = b == d && b != a && d != c ? d : e;
+            }
+            else
+            {
+                uint8_t a = above[l], b = above[x], c = above[r];
+                uint8_t d = row[l], f = row[r];
+                uint8_t g = below[l], h = below[x], k = below[r];
+                uint8_t *o = &out[x * 3];
+
+                o[0]             = d == b && b != f && d != h ? d : e;
+                o[1]             = (d == b && b != f && d != h && e != c) || (b == f && b != d && f != h && e != a) ? b : e;
+                o[2]             = b == f && b != d && f != h ? f : e;
+                o[width]         = (d == b && b != f && d != h && e != g) || (d == h && d != b && h != f && e != a) ? d : e;
+                o[width + 1]     = e;
+                o[width + 2]     = (b == f && b != d && f != h && e != k) || (h == f && d != h && b != f && e != c) ? f : e;
+                o[width * 2]     = d == h && d != b && h != f ? d : e;
+                o[width * 2 + 1] = (h == f && d != h && b != f && e != g) || (d == h && d != b && h != f && e != k) ? h : e;
+                o[width * 2 + 2] = h == f && d != h && b != f ? f : e;
+            }
+        }
+    }
+}
+
+static void postprocess_convert_rows(const struct postprocess_t *post, const struct postprocess_palette_t *palette,
+                                     const uint8_t *scaled, uint8_t *image, uint32_t first, uint32_t last)
+{
+    // Converts scaled rows first..last-1, an even count, to the output.
+    uint32_t width = post->width;
+    size_t count = (size_t) (last - first) * width;
+    const uint8_t *indices = &scaled[(size_t) first * width];
+    void (*rgba)(const uint8_t*, uint8_t*, size_t, const uint8_t (*)[4], int) = postprocess_rgba_scalar;
+    void (*luma)(const uint8_t*, uint8_t*, size_t, const uint8_t*, int) = postprocess_luma_scalar;
+    int entries = palette->entries;
+    uint32_t x, y;
+
+#ifdef POSTPROCESS_X86
+    if (entries > 8)
+        ;
+    else if (post->kernel == POSTPROCESS_KERNEL_SSE2)
+        luma = postprocess_luma_sse2;
+    else if (post->kernel == POSTPROCESS_KERNEL_AVX2)
+    {
+        rgba = postprocess_rgba_avx2;
+        luma = postprocess_luma_avx2;
+    }
+#endif
+
+    if (post->format == POSTPROCESS_RGBA)
+    {
+        rgba(indices, &image[(size_t) first * width * 4], count, (const uint8_t (*)[4]) palette->rgba, entries);
+        return;
+    }
+    luma(indices, &image[(size_t) first * width], count, palette->luma, entries);
+    if (post->format != POSTPROCESS_I420) return;
+
+    // Chroma of each 2x2 block is the rounded mean of its pixels.
+    for (y = first; y < last; y += 2)
+    {
+        const uint8_t *top = &scaled[(size_t) y * width];
+        const uint8_t *bottom = top + width;
+        uint8_t *u = &image[(size_t) width * post->height + (size_t) (y / 2) * (width / 2)];
+        uint8_t *v = u + (size_t) (width / 2) * (post->height / 2);
+
+        for (x = 0; x < width; x += 2)
+        {
+            u[x / 2] = (palette->chroma_u[top[x]] + palette->chroma_u[top[x + 1]] +
+                        palette->chroma_u[bottom[x]] + palette->chroma_u[bottom[x + 1]] + 2) / 4;
+            v[x / 2] = (palette->chroma_v[top[x]] + palette->chroma_v[top[x + 1]] +
+                        palette->chroma_v[bottom[x]] + palette->chroma_v[bottom[x + 1]] + 2) / 4;
+        }
+    }
+}
+
+static void postprocess_frame(const struct postprocess_t *post, const struct postprocess_palette_t *palette,
+                              const uint8_t *frame, uint8_t *scaled, uint8_t *image)
+{
+    // Rows in batches, so the scaled rows are still in cache when they
+    // are converted.
+    uint32_t row;
+
+    for (row = 0; row < SCREEN_HEIGHT; row += POSTPROCESS_BATCH_ROWS)
+    {
+        uint32_t last = row + POSTPROCESS_BATCH_ROWS < SCREEN_HEIGHT ? row + POSTPROCESS_BATCH_ROWS : SCREEN_HEIGHT;
+        postprocess_scale_rows(post, palette, frame, scaled, row, last);
+        postprocess_convert_rows(post, palette, scaled, image, row * post->scale, last * post->scale);
+    }
+}
+
+static void postprocess_set_color(struct postprocess_palette_t *palette, int index, int r, int g, int b)
+{
+    palette->rgba[index][0] = r;
+    palette->rgba[index][1] = g;
+    palette->rgba[index][2] = b;
+    palette->rgba[index][3] = 0xff;
+    palette->luma[index]     = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+    palette->chroma_u[index] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+    palette->chroma_v[index] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+static void postprocess_build_palette(struct postprocess_palette_t *palette, uint8_t filter, const uint16_t *colors)
+{
+    // DMG shades are the gray ramp of the video writer. CGB colors are
+    // RGB555 from palette RAM. Grid indices are three quarters as bright.
+    static const uint8_t shades[4] = { 0xff, 0xaa, 0x55, 0x00 };
+    int k;
+
+    palette->grid = colors ? 0x40 : 0x04;
+    palette->entries = filter == POSTPROCESS_LCD_GRID ? palette->grid * 2 : palette->grid;
+    for (k = 0; k < palette->grid; k++)
+    {
+        uint8_t rgb[3] = { shades[k & 0x03], shades[k & 0x03], shades[k & 0x03] };
+        if (colors) frame_color_rgb(colors[k], rgb);
+        postprocess_set_color(palette, k, rgb[0], rgb[1], rgb[2]);
+        postprocess_set_color(palette, k | palette->grid, rgb[0] * 3 / 4, rgb[1] * 3 / 4, rgb[2] * 3 / 4);
+    }
+}
+
+static void *postprocess_thread(void *arg)
+{
+    struct postprocess_t *post = arg;
+    struct postprocess_palette_t colors;
+    uint8_t frame[SCREEN_WIDTH * SCREEN_HEIGHT];
+    uint8_t *scaled = malloc((size_t) post->width * post->height);
+    uint8_t *image = malloc(post->output_size);
+
+    for (;;)
+    {
+        const struct postprocess_palette_t *palette = &post->palette;
+        const uint8_t *newest;
+        uint64_t sequence = 0;
+
+        // The frame buffers have a single consumer side, so workers
+        // take turns at it.
+        pthread_mutex_lock(&post->lock);
+        newest = frame_buffers_acquire(post->buffers);
+        if (newest)
+        {
+            const uint16_t *cgb = frame_buffers_colors(post->buffers);
+            memcpy(frame, newest, sizeof(frame));
+            if (cgb) postprocess_build_palette(&colors, post->filter, cgb);
+            palette = cgb ? &colors : &post->palette;
+            sequence = post->taken++;
+        }
+        pthread_mutex_unlock(&post->lock);
+
+        if (newest == NULL)
+        {
+            struct timespec pause = { 0, 1000000 };
+            if (atomic_load(&post->stop)) break;
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        postprocess_frame(post, palette, frame, scaled, image);
+
+        pthread_mutex_lock(&post->lock);
+        while (post->delivered != sequence) pthread_cond_wait(&post->turn, &post->lock);
+        pthread_mutex_unlock(&post->lock);
+        post->deliver(image, post->output_size, post->context);
+        pthread_mutex_lock(&post->lock);
+        post->delivered++;
+        pthread_cond_broadcast(&post->turn);
+        pthread_mutex_unlock(&post->lock);
+    }
+    free(scaled);
+    free(image);
+    return NULL;
+}
+
+void postprocess_configure(struct postprocess_t *post, uint8_t filter, uint32_t scale, uint8_t format, uint8_t kernel)
+{
+    memset(post, 0, sizeof(*post));
+    if (filter == POSTPROCESS_SCALE2X) scale = 2;
+    else if (filter == POSTPROCESS_SCALE3X) scale = 3;
+    if (scale < 1) scale = 1;
+    if (scale > POSTPROCESS_MAX_SCALE) scale = POSTPROCESS_MAX_SCALE;
+    post->filter = filter;
+    post->scale = scale;
+    post->format = format;
+    post->width = SCREEN_WIDTH * scale;
+    post->height = SCREEN_HEIGHT * scale;
+    post->output_size = (size_t) post->width * post->height;
+    if (format == POSTPROCESS_RGBA) post->output_size *= 4;
+    if (format == POSTPROCESS_I420) post->output_size += post->output_size / 2;
+
+    postprocess_build_palette(&post->palette, filter, NULL);
+
+    post->kernel = kernel == POSTPROCESS_KERNEL_AUTO ? POSTPROCESS_KERNEL_SCALAR : kernel;
+#ifdef POSTPROCESS_X86
+    if (kernel == POSTPROCESS_KERNEL_AUTO)
+        post->kernel = __builtin_cpu_supports("avx2") ? POSTPROCESS_KERNEL_AVX2 : POSTPROCESS_KERNEL_SSE2;
+#else
+    post->kernel = POSTPROCESS_KERNEL_SCALAR;
+#endif
+}
+
+int postprocess_start(struct postprocess_t *post, struct frame_buffers_t *buffers, int threads,
+                      void (*deliver)(const uint8_t*, size_t, void*), void *context)
+{
+    // Call postprocess_configure() first.
+    int i;
+
+    if (threads < 1) threads = 1;
+    if (threads > POSTPROCESS_MAX_THREADS) threads = POSTPROCESS_MAX_THREADS;
+    post->buffers = buffers;
+    post->deliver = deliver;
+    post->context = context;
+    atomic_init(&post->stop, 0);
+    pthread_mutex_init(&post->lock, NULL);
+    pthread_cond_init(&post->turn, NULL);
+    for (i = 0; i < threads; i++)
+        if (pthread_create(&post->threads[i], NULL, postprocess_thread, post) != 0) break;
+    post->thread_count = i;
+    return i ? 0 : -1;
+}
+
+void postprocess_stop(struct postprocess_t *post)
+{
+    int i;
+
+    atomic_store(&post->stop, 1);
+    for (i = 0; i < post->thread_count; i++) pthread_join(post->threads[i], NULL);
+}
+
+#ifndef GB_LIBRARY
+static void postprocess_write_file(const uint8_t *image, size_t size, void *context)
+{
+    fwrite(image, size, 1, context);
+}
+
+static int postprocess_benchmark_main(void)
+{
+    // Time per frame of every filter and output for each kernel the
+    // host has, and check that all kernels agree.
+    static const char *filters[] = { "nearest4x", "scale2x", "scale3x", "lcd4x" };
+    static const char *formats[] = { "gray", "rgba", "i420" };
+    static const char *kernels[] = { "", "scalar", "sse2", "avx2" };
+    static struct postprocess_t post;
+    uint8_t frame[SCREEN_WIDTH * SCREEN_HEIGHT];
+    uint8_t *scaled = malloc((size_t) SCREEN_WIDTH * SCREEN_HEIGHT * POSTPROCESS_MAX_SCALE * POSTPROCESS_MAX_SCALE);
+    uint8_t *image = malloc((size_t) SCREEN_WIDTH * SCREEN_HEIGHT * POSTPROCESS_MAX_SCALE * POSTPROCESS_MAX_SCALE * 4);
+    uint8_t *reference = malloc((size_t) SCREEN_WIDTH * SCREEN_HEIGHT * POSTPROCESS_MAX_SCALE * POSTPROCESS_MAX_SCALE * 4);
+    uint8_t last_kernel = POSTPROCESS_KERNEL_SCALAR;
+    int filter, format, kernel, i, mismatches = 0;
+
+#ifdef POSTPROCESS_X86
+    last_kernel = __builtin_cpu_supports("avx2") ? POSTPROCESS_KERNEL_AVX2 : POSTPROCESS_KERNEL_SSE2;
+#endif
+    // A frame with both flat areas and edges: diagonal bands.
+    for (i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+        frame[i] = ((i % SCREEN_WIDTH + i / SCREEN_WIDTH) / 12) & 0x03;
+
+    printf("filter,format,kernel,us_per_frame\n");
+    for (filter = POSTPROCESS_NEAREST; filter <= POSTPROCESS_LCD_GRID; filter++)
+    {
+        for (format = POSTPROCESS_GRAY; format <= POSTPROCESS_I420; format++)
+        {
+            for (kernel = POSTPROCESS_KERNEL_SCALAR; kernel <= last_kernel; kernel++)
+            {
+                uint64_t start;
+                postprocess_configure(&post, filter, 4, format, kernel);
+                postprocess_frame(&post, &post.palette, frame, scaled, image);
+                start = host_time_ns();
+                for (i = 0; i < 200; i++) postprocess_frame(&post, &post.palette, frame, scaled, image);
+                printf("%s,%s,%s,%.1f\n", filters[filter], formats[format], kernels[kernel], (host_time_ns() - start) / 200e3);
+
+                if (kernel == POSTPROCESS_KERNEL_SCALAR) memcpy(reference, image, post.output_size);
+                else if (memcmp(reference, image, post.output_size) != 0) mismatches++;
+            }
+        }
+    }
+    free(scaled);
+    free(image);
+    free(reference);
+    if (mismatches) printf("[ERROR] %d kernel outputs differ from the scalar ones.\n", mismatches);
+    return mismatches ? 1 : 0;
+}
+#endif // GB_LIBRARY
+
+#ifndef GB_LIBRARY
+static volatile sig_atomic_t main_interrupted;
+
+static void main_interrupt(int signal)
+{
+    // Ends the run loop, so writers flush and metrics are removed.
+    (void) signal;
+    main_interrupted = 1;
+}
+
+// SDL2 https://lazyfoo.net/tutorials/SDL/01_hello_SDL/mac/index.php
+// Boot sequence https://knight.sc/reverse%20engineering/2018/11/19/game-boy-boot-sequence.html
+int main(int argc, char *argv[]) 
+{
+    struct gameboy_emulator_t emulator;
+    const char *rom = NULL;
+    const char *cache_dir = NULL;
+    const char *audio = NULL;
+    const char *video = NULL;
+    int post = 0;
+    int post_threads = 2;
+    uint8_t post_filter = POSTPROCESS_NEAREST;
+    uint8_t post_format = POSTPROCESS_GRAY;
+    uint32_t post_scale = 1;
+    const char *hash_path = NULL;
+    const char *golden = NULL;
+    const char *record = NULL;
+    const char *play = NULL;
+    const char *link_path = NULL;
+    int link_listen = 0;
+    static struct movie_t movie;
+    static struct link_port_t link;
+    uint32_t hash_interval = 60;
+    int boot_mode = BOOT_FULL;
+    int debug = 0;
+    int export_metrics = 0;
+    static struct metrics_t metrics;
+    int realtime = 0;
+    int trace = 0;
+    static struct pacer_t pacer;
+    static struct audio_output_t output;
+    static struct audio_ring_t ring;
+    static struct audio_writer_t writer;
+    static struct frame_buffers_t buffers;
+    static struct video_writer_t video_writer;
+    static struct postprocess_t postprocess;
+    FILE *video_file = NULL;
+    static struct hash_log_t hash_log;
+    uint64_t frames = 0;
+    uint64_t frame;
+    int i;
+
+    // $ ./a.out --bench > baseline.csv
+    // $ ./a.out --bench baseline.csv       (exit status 1 on regression)
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+        return benchmark_main(argc > 2 ? argv[2] : NULL);
+
+    // $ ./a.out --train                    (profile collection run of the PGO build)
+    if (argc > 1 && strcmp(argv[1], "--train") == 0)
+        return train_main();
+
+    // $ ./a.out --profile 600 game [--skip-boot | --boot-cache dir] [rom.gb]
+    //                                      (600 frames to game.flat, game.folded, game.coverage)
+    if (argc > 3 && strcmp(argv[1], "--profile") == 0)
+    {
+        for (i = 4; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--skip-boot") == 0) boot_mode = BOOT_SKIP;
+            else if (strcmp(argv[i], "--boot-cache") == 0 && i + 1 < argc)
+            {
+                boot_mode = BOOT_CACHED;
+                cache_dir = argv[++i];
+            }
+            else rom = argv[i];
         }
-        case 0xe2: 
+        return profile_main(strtoull(argv[2], NULL, 0), argv[3], rom, boot_mode, cache_dir);
+    }
+
+    // $ ./a.out --serve /tmp/gb.sock [workers]    (or --serve 127.0.0.1:9000)
+    if (argc > 2 && strcmp(argv[1], "--serve") == 0)
+        return server_main(argv[2], argc > 3 ? atoi(argv[3]) : (int) sysconf(_SC_NPROCESSORS_ONLN));
+
+    // $ ./a.out --bench-post                  (exit status 1 if SIMD and scalar output differ)
+    if (argc > 1 && strcmp(argv[1], "--bench-post") == 0)
+        return postprocess_benchmark_main();
+
+    // $ ./a.out --bench-rollback [frames]     (exit status 1 if slower than one frame)
+    if (argc > 1 && strcmp(argv[1], "--bench-rollback") == 0)
+        return rollback_benchmark_main(argc > 2 ? strtoul(argv[2], NULL, 0) : 8);
+
+    // $ ./a.out --conformance sm83/v1 [threads]   (exit status 1 if any case differs)
+    if (argc > 2 && strcmp(argv[1], "--conformance") == 0)
+        return conformance_main(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+
+    // $ ./a.out --top [interval seconds] [samples]   (runs until interrupted without a sample count)
+    if (argc > 1 && strcmp(argv[1], "--top") == 0)
+        return metrics_top_main(argc > 2 ? atof(argv[2]) : 1.0, argc > 3 ? atoi(argv[3]) : 0);
+
+    // $ ./a.out --hash-compare golden.hashes run.hashes
+    if (argc > 3 && strcmp(argv[1], "--hash-compare") == 0)
+        return hash_log_compare(argv[2], argv[3]) == 0 ? 0 : 1;
+
+    // $ ./a.out [--debug] [--skip-boot | --boot-cache dir] [--frames n] [--audio out.pcm] [--video out.raw]
+    //           [--video-filter nearest|scale2x|scale3x|lcd] [--video-scale n] [--video-format gray|rgba|i420]
+    //           [--video-threads n] [--metrics] [--realtime] [--trace]
+    //           [--hash-log out.hashes] [--hash-check golden.hashes] [--hash-interval frames]
+    //           [--record out.movie | --play in.movie] [--link-listen path | --link-connect path] [rom.gb]
+    // A played movie runs to its last input unless --frames is given. --metrics exports counters for --top.
+    // Runs in real time until interrupted without --frames or --play; --realtime paces those too.
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--debug") == 0) debug = 1;
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) frames = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--audio") == 0 && i + 1 < argc) audio = argv[++i];
+        else if (strcmp(argv[i], "--video") == 0 && i + 1 < argc) video = argv[++i];
+        else if (strcmp(argv[i], "--video-filter") == 0 && i + 1 < argc)
         {
-            uint16_t addr = 0xff00 + emulator->cpu.reg.bc.low;
-            load_immed_data_r(emulator, addr, 0x07);
-            break;
+            const char *name = argv[++i];
+            post = 1;
+            post_filter = strcmp(name, "scale2x") == 0 ? POSTPROCESS_SCALE2X :
+                          strcmp(name, "scale3x") == 0 ? POSTPROCESS_SCALE3X :
+                          strcmp(name, "lcd") == 0 ? POSTPROCESS_LCD_GRID : POSTPROCESS_NEAREST;
         }
-        case 0xf0: 
+        else if (strcmp(argv[i], "--video-scale") == 0 && i + 1 < argc)
         {
-            uint8_t addr = read_8_bit_immed_data_from_memory(emulator);
-            load_r_immed_data(emulator, 0x07, addr);
-            break;
+            post = 1;
+            post_scale = strtoul(argv[++i], NULL, 0);
         }
-        case 0xe0: 
+        else if (strcmp(argv[i], "--video-format") == 0 && i + 1 < argc)
         {
-            uint8_t addr = read_8_bit_immed_data_from_memory(emulator);
-            load_immed_data_r(emulator, addr, 0x07);
-            break;
+            const char *name = argv[++i];
+            post = 1;
+            post_format = strcmp(name, "rgba") == 0 ? POSTPROCESS_RGBA :
+                          strcmp(name, "i420") == 0 ? POSTPROCESS_I420 : POSTPROCESS_GRAY;
         }
-        case 0xfa: 
+        else if (strcmp(argv[i], "--video-threads") == 0 && i + 1 < argc) post_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--hash-log") == 0 && i + 1 < argc) hash_path = argv[++i];
+        else if (strcmp(argv[i], "--hash-check") == 0 && i + 1 < argc) golden = argv[++i];
+        else if (strcmp(argv[i], "--hash-interval") == 0 && i + 1 < argc) hash_interval = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) record = argv[++i];
+        else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc) play = argv[++i];
+        else if (strcmp(argv[i], "--link-listen") == 0 && i + 1 < argc)
         {
-            uint16_t addr = read_16_bit_immed_data_from_memory(emulator);
-            load_r_immed_data(emulator, 0x07, addr);
-            break;
+            link_listen = 1;
+            link_path = argv[++i];
         }
-        case 0xea: 
+        else if (strcmp(argv[i], "--link-connect") == 0 && i + 1 < argc) link_path = argv[++i];
+        else if (strcmp(argv[i], "--metrics") == 0) export_metrics = 1;
+        else if (strcmp(argv[i], "--realtime") == 0) realtime = 1;
+        else if (strcmp(argv[i], "--trace") == 0) trace = 1;
+        else if (strcmp(argv[i], "--skip-boot") == 0) boot_mode = BOOT_SKIP;
+        else if (strcmp(argv[i], "--boot-cache") == 0 && i + 1 < argc)
         {
-            uint16_t addr = read_16_bit_immed_data_from_memory(emulator);
-            load_immed_data_r(emulator, addr, 0x07);
-            break;
+            boot_mode = BOOT_CACHED;
+            cache_dir = argv[++i];
         }
-        case 0x2a: 
+        else rom = argv[i];
+    }
+
+    emulator_initialize(&emulator);
+    emulator.trace = trace;
+    if (rom && emulator_load_rom(&emulator, rom) != 0) return 1;
+    if (emulator_boot(&emulator, boot_mode, cache_dir) != 0)
+    {
+        printf("[ERROR] Boot ROM did not reach the cartridge entry point.\n");
+        dum_cpu_registers(&emulator);
+        return 1;
+    }
+    if (play && movie_play_start(&emulator, &movie, play) != 0) return 1;
+    if (record && movie_record_start(&emulator, &movie, record) != 0)
+    {
+        printf("[ERROR] Cannot record to %s.\n", record);
+        return 1;
+    }
+    if (link_path && link_connect_socket(&emulator, &link, link_path, link_listen) != 0)
+    {
+        printf("[ERROR] Cannot link through %s.\n", link_path);
+        return 1;
+    }
+
+    if (debug)
+    {
+        static struct debugger_t debugger;
+        debugger_attach(&emulator, &debugger);
+        debugger_console(&emulator);
+        movie_stop(&emulator);
+        return 0;
+    }
+
+    // Without a frame count or movie the machine runs in real time
+    // until interrupted; otherwise as fast as possible, unless asked.
+    if (!frames && !play) realtime = 1;
+    signal(SIGINT, main_interrupt);
+    signal(SIGTERM, main_interrupt);
+
+    if (hash_path || golden)
+    {
+        if (hash_log_open(&hash_log, hash_path, golden, hash_interval) != 0)
         {
-            load_r_immed_data(emulator, 0x07, emulator->cpu.reg.hl.data);
-            emulator->cpu.reg.hl.data = emulator->cpu.reg.hl.data + 1;
-            break;
+            printf("[ERROR] Cannot open hash log.\n");
+            return 1;
         }
-        case 0x3a: 
+        hash_log_attach(&emulator, &hash_log);
+    }
+
+    if (video)
+    {
+        int failed;
+
+        frame_buffers_attach(&emulator, &buffers);
+        if (post)
         {
-            load_r_immed_data(emulator, 0x07, emulator->cpu.reg.hl.data);
-            emulator->cpu.reg.hl.data = emulator->cpu.reg.hl.data - 1;
-            break;
+            postprocess_configure(&postprocess, post_filter, post_scale, post_format, POSTPROCESS_KERNEL_AUTO);
+            failed = (video_file = fopen(video, "wb")) == NULL ||
+                     postprocess_start(&postprocess, &buffers, post_threads, postprocess_write_file, video_file) != 0;
+            if (!failed)
+                printf("[INFO ] Video is %ux%u, %zu bytes per frame.\n",
+                       postprocess.width, postprocess.height, postprocess.output_size);
         }
-        case 0x02:
-            load_immed_data_r(emulator, emulator->cpu.reg.bc.data, 0x07);
-            break;
-        case 0x12:
-            load_immed_data_r(emulator, emulator->cpu.reg.de.data, 0x07);
-            break;
-        case 0x22: 
+        else failed = video_writer_start(&video_writer, &buffers, video) != 0;
+        if (failed)
         {
-            load_immed_data_r(emulator, emulator->cpu.reg.hl.data, 0x07);
-            emulator->cpu.reg.hl.data = emulator->cpu.reg.hl.data + 1;
-            break;
+            printf("[ERROR] Cannot write video to %s.\n", video);
+            return 1;
         }
-        case 0x32: 
+    }
+    if (audio)
+    {
+        if (audio_ring_initialize(&ring, 1 << 16) != 0 || audio_writer_start(&writer, &ring, audio) != 0)
         {
-            load_immed_data_r(emulator, emulator->cpu.reg.hl.data, 0x07);
-            emulator->cpu.reg.hl.data = emulator->cpu.reg.hl.data - 1;
-            break;
+            printf("[ERROR] Cannot write audio to %s.\n", audio);
+            return 1;
         }
-        // 8-bit arithmetic and logic operation instructions
-        // TDOD. adc, sbc
-        case 0x87:
-        case 0x80 ... 0x85:
-            add_a_r(emulator);
-            break;
-        case 0x97:
-        case 0x90 ... 0x95:
-            sub_a_r(emulator);
-            break;
-        case 0xa7:
-        case 0xa0 ... 0xa5:
-            and_a_r(emulator);
-            break;
-        case 0xb7:
-        case 0xb0 ... 0xb5:
-            or_a_r(emulator);
-            break;
-        case 0xaf:
-        case 0xa8:
-        case 0xa9:
-        case 0xaa ... 0xad:
-            xor_a_r(emulator);
-            break;
-        case 0xfe:  // CP a, n
-            cp_a_n(emulator);
-            break;
-        case 0xbf:  // CP a, r
-        case 0xb8 ... 0xbd:
-            cp_a_r(emulator);
-            break;
-        case 0x04:
-        case 0x0c:
-        case 0x14:
-        case 0x1c:
-        case 0x3c:
-        case 0x24:
-        case 0x2c:
-            inc_r(emulator);
-            break;
-        case 0x3d:
-        case 0x05:
-        case 0x0d:
-        case 0x15:
-        case 0x1d:
-        case 0x25:
-        case 0x2d:
-            dec_r(emulator);
-            break;
-        // Roatate shift instructions
-        case 0x07:
-            rlca(emulator);
-            break;
-        case 0x17:
-            rla(emulator);
-            break;
-        case 0x0f: 
-            rrca(emulator);
-            break;
-        case 0x1f:
-            rra(emulator);
-            break;
-        // Extended instructions
-        case 0xcb:
-            // RLC r
-            // RL  r
-            // RRC r
-            // RR  r
-            // SLA r
-            // SRA r
-            // SRL r
-            // BIT b, r
-            bit_operations(emulator);
-            break;
-        // Jump instructions
-        case 0xc3:  // JP nn
-            jump_nn(emulator, read_16_bit_immed_data_from_memory(emulator));
-            break;
-        case 0xc2:
-        case 0xca:
-        case 0xd2:
-        case 0xda:  // JP cc, nn
-            jump_cc_nn(emulator, read_16_bit_immed_data_from_memory(emulator));
-            break;
-        case 0x20:
-        case 0x28:
-        case 0x30:
-        case 0x38:  // JR cc, n
-            jump_cc_n(emulator, read_8_bit_immed_data_from_memory(emulator));
-            break;
-        case 0x18:  // JR n
-            jump_n(emulator, read_8_bit_immed_data_from_memory(emulator));
-            break;
-        case 0xe9:  // JP (hl)
-            jump_nn(emulator, emulator->cpu.reg.hl.data);
-            break;
-        // Call instructions
-        case 0xcd:  // Call nn
-            call_nn(emulator, read_16_bit_immed_data_from_memory(emulator));
-            break;
-        case 0xc4:  // Call cc, nn
-        case 0xcc:
-        case 0xd4:
-        case 0xdc:
-            call_cc_nn(emulator, read_16_bit_immed_data_from_memory(emulator));
-            break;
-        case 0xc9:  // RET
-            ret(emulator);
-            break;
-        case 0xc0:
-        case 0xc8:
-        case 0xd0:
-        case 0xd8:
-            ret_cc(emulator);
-            break;
-        // 16 bit transfer instructions
-        case 0x01:  // LD rr, nn
-        case 0x11:
-        case 0x21:
-        case 0x31:
-            ld_rr_nn(emulator);
-            break;
-        case 0xc5:  // Push rr
-        case 0xd5:
-        case 0xe5:
-        case 0xf5:
-            push_qq(emulator);
-            break;
-        case 0xc1:  // Pop rr
-        case 0xd1:
-        case 0xe1:
-        case 0xf1:
-            pop_qq(emulator);
-            break;
-        case 0xf9:
-            emulator->cpu.reg.sp.data = emulator->cpu.reg.hl.data;
-            break;
-        case 0x08:
-            ld_nn_sp(emulator);
-            break;
-        // 16 bit atirthmetic
-        case 0x03:  // INC rr
-        case 0x13:
-        case 0x23:
-        case 0x33:
-            inc_rr(emulator);
-            break;
-        case 0x0b:  // DEC rr
-        case 0x1b:
-        case 0x2b:
-        case 0x3b:
-            dec_rr(emulator);
-            break;
-        default:
+        apu_attach_output(&emulator, &output, &ring, 48000);
+    }
+    if (export_metrics)
+    {
+        if (metrics_open(&metrics) != 0)
         {
-            printf("[DEBUG] Instruction $%x Not Implemented.\n", emulator->opcode);
-            dum_cpu_registers(emulator);
-            exit(0);
+            printf("[ERROR] Cannot export metrics.\n");
+            return 1;
         }
+        metrics_attach(&emulator, &metrics);
+        printf("[INFO ] Exporting metrics as %s.\n", metrics.name);
     }
-}
-
-void ppu_step_emulator(struct gameboy_emulator_t *emulator)
-{
-
-}
-
-// SDL2 https://lazyfoo.net/tutorials/SDL/01_hello_SDL/mac/index.php
-// Boot sequence https://knight.sc/reverse%20engineering/2018/11/19/game-boy-boot-sequence.html
-int main(int argc, char *argv[]) 
-{
-    struct gameboy_emulator_t emulator;
-
-    emulator_initialize(&emulator);
-
-    for ( ;/* Enter infinite loop */; )
+    if (realtime) pacer_start(&pacer, audio ? &ring : NULL, PACER_AUDIO_TARGET);
+    for (frame = 0; (frames ? frame < frames : !play || movie.pending) && !hash_log.mismatch && !main_interrupted; frame++)
+    {
+        if (realtime) pacer_wait(&pacer);
+        emulator_run_until_vblank(&emulator);
+        if (realtime) pacer_advance(&pacer);
+    }
+    if (realtime && pacer.resyncs) printf("[WARN ] Fell behind real time %llu times.\n", (unsigned long long) pacer.resyncs);
+    if (export_metrics) metrics_close(&metrics);
+    if (hash_path || golden) hash_log_close(&hash_log);
+    movie_stop(&emulator);
+    if (audio)
     {
-        cpu_step_emulator(&emulator);
-        ppu_step_emulator(&emulator);
+        audio_writer_stop(&writer);
+        if (atomic_load(&ring.overruns)) printf("[WARN ] %u audio frames dropped.\n", atomic_load(&ring.overruns));
     }
+    if (video)
+    {
+        uint64_t written;
 
-    return 0;
+        if (post)
+        {
+            postprocess_stop(&postprocess);
+            fclose(video_file);
+            written = postprocess.delivered;
+        }
+        else
+        {
+            video_writer_stop(&video_writer);
+            written = video_writer.written;
+        }
+        if (written < buffers.published)
+            printf("[INFO ] %llu of %llu video frames written.\n",
+                   (unsigned long long) written, (unsigned long long) buffers.published);
+    }
+    return hash_log.mismatch ? 1 : 0;
 }
+#endif // GB_LIBRARY